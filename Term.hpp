@@ -11,25 +11,14 @@
 #include <type_traits>
 #include <deque>
 #include <exception>
+#include <stdexcept>
 #include <utility>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include "handle.hpp"
 #include "sub.hpp"
 
-template<typename T>
-class function;
-template<typename T>
-class literal;
-template<typename T>
-class variable;
-
-template<typename T>
-using term_ptr = std::shared_ptr<term<T>>;
-template<typename T>
-using variable_ptr = std::shared_ptr<variable<T>>;
-template<typename T>
-using literal_ptr = std::shared_ptr<literal<T>>;
-template<typename T>
-using function_ptr = std::shared_ptr<function<T>>;
-
 template<typename T>
 using rule = std::pair<term_ptr<T>, term_ptr<T>>;
 
@@ -38,6 +27,12 @@ typedef std::deque<uint32_t> path;
 template<typename T>
 class term_iterator;
 
+/*!
+ * \brief What a term actually is, every node carries one so we can switch on
+ * it rather than going through virtual calls
+ */
+enum class term_kind : uint8_t { variable, literal, function };
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Exceptions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -48,6 +43,45 @@ class InvalidPathException: public std::exception
 class InvalidRuleException: public std::exception
 {public: const char * what() const noexcept{ return "Invalid Rule";}};
 
+class CyclicTermException: public std::exception
+{public: const char * what() const noexcept{ return "Cyclic Term, it failed the occurs check";}};
+
+class UnknownSymbolException: public std::exception
+{public: const char * what() const noexcept{ return "Unknown Symbol";}};
+
+class InvalidArityException: public std::exception
+{public: const char * what() const noexcept{ return "Invalid Arity, wrong number of children for the function";}};
+
+class TraceGapException: public std::exception
+{public: const char * what() const noexcept{ return "Trace Gap, steps are missing from the trace";}};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Symbols
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief function names as small ids, 0 is every variable and 1 every literal,
+ * names get ids from 2 on as they're seen
+ *
+ * There is one table for the whole process, so a function node can keep its
+ * id once it has been looked up, see term::symbol().
+ */
+class symbol_table
+{
+public:
+    static const uint32_t variable_id = 0;
+    static const uint32_t literal_id = 1;
+
+    static uint32_t id(const std::string& name)
+    {
+        static std::mutex lock;
+        static std::unordered_map<std::string, uint32_t> ids;
+        std::lock_guard<std::mutex> hold(lock);
+        auto found = ids.emplace(name, ids.size() + 2);
+        return found.first->second;
+    }
+};
+
 /*!
  * \brief Class Term, base class for terms
  */
@@ -70,7 +104,12 @@ public:
 
     // Our base class constructor
 
-    term(){}
+    term(term_kind __kind): _kind{__kind}{}
+    virtual ~term(){}
+
+    // A copy is a new node, it doesn't get the count of the one it came from
+    term(const term<T>& rhs): _kind{rhs._kind}, _normalized{rhs._normalized}{}
+    term<T>& operator=(const term<T>& rhs){ _normalized = rhs._normalized; return *this; }
 
     // Our iterators
     iterator begin(){return iterator(this);}
@@ -85,29 +124,71 @@ public:
     virtual bool operator==(const term<T>& /*rhs*/)const{return false;}
 
     // Eh, pains me to write, base class shouldn't know anything about
-    // derived classes
-    virtual bool isVariable( )const{return false;}
-    virtual bool isLiteral ( )const{return false;}
-    virtual bool isFunction( )const{return false;}
+    // derived classes. At least now it's a tag and not a virtual call.
+    term_kind kind( )const{return _kind;}
+    bool isVariable( )const{return _kind == term_kind::variable;}
+    bool isLiteral ( )const{return _kind == term_kind::literal;}
+    bool isFunction( )const{return _kind == term_kind::function;}
 
     // Find a specific term and build its path
-    virtual bool find_path(path& p, term<T>& t)=0;
+    bool find_path(path& p, term<T>& t);
+
+    // The id of our symbol in the symbol_table
+    uint32_t symbol()const;
 
     // Utility functions
     virtual std::ostream& pp(std::ostream&) const=0;
     virtual term_ptr<T> clone() const = 0;
 
     // Does anyone thing of the children?
-    virtual std::vector< term_ptr<T> >& children( )=0;
+    std::vector< term_ptr<T> >& children( );
 
     // Rewrite routines
-            term_ptr<T> rewrite(term_ptr<T>, path, Sub<T>);
-    virtual term_ptr<T> rewrite(Sub<T>&) = 0;
+    term_ptr<T> rewrite(term_ptr<T>, path, Sub<T>);
+    term_ptr<T> rewrite(Sub<T>&);
+
+    // Normal form bookkeeping, a node is only marked normalized once
+    // nothing under it can be reduced by the rules it was normalized with
+    bool normalized()const{return _normalized;}
+    void normalized(bool n){_normalized = n;}
+    void invalidate(path p);
+
+#ifdef TERM_INTRUSIVE_REFCOUNT
+    // Intrusive counting for term_handle, see handle.hpp. Until a node is
+    // published only its one thread counts, a relaxed load and store is a
+    // plain one and needs no locked instruction. Once published it counts atomically.
+    void retain()const
+    {
+        if( _published ) _refs.fetch_add(1, std::memory_order_relaxed);
+        else _refs.store(_refs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    void release()const
+    {
+        if( _published )
+        {
+            if( _refs.fetch_sub(1, std::memory_order_acq_rel) == 1 ) delete this;
+            return;
+        }
+        uint32_t n = _refs.load(std::memory_order_relaxed) - 1;
+        _refs.store(n, std::memory_order_relaxed);
+        if( n == 0 ) delete this;
+    }
+    long refs()const{return _refs.load(std::memory_order_relaxed);}
+    bool published()const{return _published;}
+    void publish()const{_published = true;}
+#endif
 
 private:
 
     term_ptr<T> rewrite(term_ptr<T> t, term_ptr<T> r, path p);
 
+    term_kind _kind;
+    bool _normalized{false};
+#ifdef TERM_INTRUSIVE_REFCOUNT
+    mutable bool _published{false};
+    mutable std::atomic<uint32_t> _refs{0};
+#endif
+
 };
 
 template<typename T>
@@ -174,15 +255,15 @@ public:
     variable<T>& operator=(const variable<T>&);
 
     // Move symantics
-    variable( const variable<T>&& );
-    variable<T>& operator=(const variable<T>&&);
+    variable( variable<T>&& ) noexcept;
+    variable<T>& operator=(variable<T>&&) noexcept;
 
     // Var
     std::string var(){ return _var; }
 
     // Utility Functions
     std::ostream& pp(std::ostream&) const;
-    term_ptr<T> clone() const{return std::make_shared<variable>(*this);}
+    term_ptr<T> clone() const{return make_term<variable>(*this);}
 
     // Our operators
     bool operator!=(const term<T>& rhs)const {return !(*this == rhs);}
@@ -207,7 +288,6 @@ public:
 
     // Utility
     bool find_path(path& p, term<T>& t);
-    bool isVariable()const{return true;}
 
     std::vector< term_ptr<T> >& children( ){return _children;}
 
@@ -229,8 +309,8 @@ public:
     literal<T>& operator=(const literal<T>&);
 
     // move symantics
-    literal( const literal<T>&& );
-    literal<T>& operator=(const literal<T>&&);
+    literal( literal<T>&& ) noexcept;
+    literal<T>& operator=(literal<T>&&) noexcept;
 
     // Our values
     T& value(){return _value;}
@@ -238,9 +318,8 @@ public:
 
     std::vector< term_ptr<T> > _children{};
     std::vector< term_ptr<T> >& children( ){return _children;}
-    term_ptr<T> rewrite(term_ptr<T>, Sub<T>);
     std::ostream& pp(std::ostream&) const;
-    term_ptr<T> clone() const{return std::make_shared<literal>(*this);}
+    term_ptr<T> clone() const{return make_term<literal>(*this);}
 
     // Our operators
     bool operator!=(const term<T>& rhs)const{return !(*this == rhs);}
@@ -263,7 +342,6 @@ public:
 
     // Utilities
     bool find_path(path& p, term<T> &t);
-    bool isLiteral( )const{return true;}
 
 private:
     T _value;
@@ -278,51 +356,68 @@ template<typename T>
 class function: public term<T>{
 public:
     // Our constructors construct
-    function(std::string __name, uint32_t __arity, std::vector<std::shared_ptr< term<T>>> __subterms );
+    function(std::string __name, uint32_t __arity, std::vector< term_ptr<T> > __subterms );
     function( const function<T>& );
     function<T>& operator=(const function<T>&);
 
     // Move Semantics
-    function( const function<T>&&);
-    function<T>& operator=(const function<T>&&);
+    function( function<T>&&) noexcept;
+    function<T>& operator=(function<T>&&) noexcept;
 
     // Why yes we have children, would you like to see?
     std::vector< term_ptr<T> >& children( ){return _subterms;}
 
     // Our Operators
     bool operator!=(const term<T>& rhs)const{return !(*this == rhs);}
-    bool operator==(const term<T>& __rhs)const
+    bool operator==(const term<T>& rhs)const
     {
-        const function<T>& rhs = static_cast<const function<T>&>(__rhs);
         if(rhs.isFunction())
         {
-            // Stupid double dispatch
-            //return *this == static_cast<const function<T>&>(rhs);
-            return _name == rhs._name && _arity == rhs._arity && _subterms == rhs._subterms;
+            return *this == static_cast<const function<T>&>(rhs);
         }
         return false;
     }
     // These two are overshadowed by their more general counterparts
     bool operator!=(const function<T>& rhs)const{return !(*this == rhs);}
-    bool operator==(const function<T>& rhs)const{return _name == rhs._name && _arity == rhs._arity && _subterms == rhs._subterms;}
+    bool operator==(const function<T>& rhs)const
+    {
+        // Compare what the children are, not where they live
+        return _name == rhs._name && _arity == rhs._arity &&
+               std::equal(_subterms.begin(), _subterms.end(), rhs._subterms.begin(), rhs._subterms.end(),
+                          [](const term_ptr<T>& a, const term_ptr<T>& b){ return a == b || *a == *b; });
+    }
 
     // Rewrite
     term_ptr<T> rewrite(Sub<T> &);
 
     // Utilities
     bool find_path(path& p, term<T>& t);
-    bool isFunction( )const{return true;}
     std::ostream& pp(std::ostream&) const;
-    term_ptr<T> clone() const{return std::make_shared<function>(*this);}
+    term_ptr<T> clone() const{return make_term<function>(*this);}
 
     // Our getters
-    std::string& name(){return _name;}
+    // Handing out the name to change means looking its id up again
+    std::string& name(){_symbol.store(0, std::memory_order_relaxed); return _name;}
     const std::string& name()const{ return _name; }
+    uint32_t arity()const{ return _arity; }
+
+    // Looked up the first time it's asked for and kept, any thread can ask,
+    // they all get the same id
+    uint32_t symbol()const
+    {
+        uint32_t id = _symbol.load(std::memory_order_relaxed);
+        if( id == 0 )
+        {
+            id = symbol_table::id(_name);
+            _symbol.store(id, std::memory_order_relaxed);
+        }
+        return id;
+    }
 
 private:
     std::string _name;
-    // I literally never use this
     uint32_t _arity;
+    mutable std::atomic<uint32_t> _symbol{0};
     std::vector< term_ptr<T> > _subterms;
 };
 
@@ -372,24 +467,118 @@ term_ptr<T> term<T>::rewrite(term_ptr<T> t, term_ptr<T> r, path p)
     p.pop_front();
 
     // Grab the child and replace 'em if this is it,
-    // Our call the next one
+    // Our call the next one. We copy the child before we go into it
+    // so the original term, which shares its children with us, is left alone.
     auto child = t->children()[pos];
     if( p.empty() ){
         t->children()[pos] = r;
     }else{
-        t->children()[pos] = child->rewrite(child, r, p );
+        t->children()[pos] = child->rewrite(child->clone(), r, p );
     }
 
+    // Everything along the path has changed and needs another look
+    t->normalized(false);
     return t;
 }
 
+/*!
+ * \brief Marks every node along the path as no longer normalized, use this after
+ * changing a subterm through children() so incremental normalization revisits it
+ * \param path p, the path to the changed subterm
+ */
+template<typename T>
+void term<T>::invalidate(path p)
+{
+    term<T>* t = this;
+    t->normalized(false);
+    for(auto pos: p)
+    {
+        if( pos == 0 || pos > t->children().size() ){
+            throw InvalidPathException();
+        }
+        t = t->children()[pos-1].get();
+        t->normalized(false);
+    }
+}
+
+/*!
+ * \brief t with the subterm at path at, from index i on, swapped for r, rebuilding
+ * only the nodes along the path and sharing everything else, nothing is cloned
+ * and no marks are touched
+ */
+template<typename T>
+term_ptr<T> replace_at(const term_ptr<T>& t, const path& at, size_t i, const term_ptr<T>& r)
+{
+    if( i == at.size() )
+    {
+        return r;
+    }
+    if( !t->isFunction() || at[i] == 0 || at[i] > t->children().size() )
+    {
+        throw InvalidPathException();
+    }
+    auto& f = static_cast<function<T>&>(*t);
+    std::vector< term_ptr<T> > subterms = f.children();
+    subterms[at[i] - 1] = replace_at(subterms[at[i] - 1], at, i + 1, r);
+    return make_term<function<T>>(f.name(), f.arity(), std::move(subterms));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Dispatch on kind
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+std::vector< term_ptr<T> >& term<T>::children()
+{
+    switch( _kind ){
+    case term_kind::variable: return static_cast<variable<T>*>(this)->children();
+    case term_kind::literal:  return static_cast<literal<T>*>(this)->children();
+    case term_kind::function: return static_cast<function<T>*>(this)->children();
+    }
+    throw std::logic_error("Unknown term kind");
+}
+
+template<typename T>
+term_ptr<T> term<T>::rewrite(Sub<T>& sigma)
+{
+    switch( _kind ){
+    case term_kind::variable: return static_cast<variable<T>*>(this)->rewrite(sigma);
+    case term_kind::literal:  return static_cast<literal<T>*>(this)->rewrite(sigma);
+    case term_kind::function: return static_cast<function<T>*>(this)->rewrite(sigma);
+    }
+    throw std::logic_error("Unknown term kind");
+}
+
+template<typename T>
+bool term<T>::find_path(path& p, term<T>& t)
+{
+    switch( _kind ){
+    case term_kind::variable: return static_cast<variable<T>*>(this)->find_path(p, t);
+    case term_kind::literal:  return static_cast<literal<T>*>(this)->find_path(p, t);
+    case term_kind::function: return static_cast<function<T>*>(this)->find_path(p, t);
+    }
+    throw std::logic_error("Unknown term kind");
+}
+
+template<typename T>
+uint32_t term<T>::symbol()const
+{
+    switch( _kind ){
+    case term_kind::variable: return symbol_table::variable_id;
+    case term_kind::literal:  return symbol_table::literal_id;
+    case term_kind::function: return static_cast<const function<T>*>(this)->symbol();
+    }
+    throw std::logic_error("Unknown term kind");
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Implementation: Variable
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<typename T>
 variable<T>::variable(std::string __var):
-    _var{__var}
+    term<T>{term_kind::variable},
+    _var{std::move(__var)}
 {
 }
 
@@ -401,22 +590,26 @@ variable<T>::variable(const variable<T>& rhs ):
 }
 
 template<typename T>
-variable<T>::variable(const variable<T>&& rhs ):
+variable<T>::variable(variable<T>&& rhs ) noexcept:
     term<T>{rhs},
     _var{std::move(rhs._var)}
 {
 }
 
 template<typename T>
-variable<T>& variable<T>::operator=(const variable<T>&& rhs )
+variable<T>& variable<T>::operator=(variable<T>&& rhs ) noexcept
 {
-    _var = rhs._var;
+    term<T>::operator=(rhs);
+    _var = std::move(rhs._var);
+    return *this;
 }
 
 template<typename T>
 variable<T>& variable<T>::operator=(const variable<T>& rhs)
 {
+    term<T>::operator=(rhs);
     _var = rhs._var;
+    return *this;
 }
 
 template<typename T>
@@ -449,7 +642,8 @@ bool variable<T>::find_path(path& /*p*/, term<T> &t)
 
 template<typename T>
 literal<T>::literal( T __value ):
-    _value{__value}
+    term<T>{term_kind::literal},
+    _value{std::move(__value)}
 {
 }
 
@@ -463,19 +657,22 @@ literal<T>::literal(const literal<T>& c ):
 template<typename T>
 literal<T>& literal<T>::operator=(const literal<T>& rhs)
 {
+    term<T>::operator=(rhs);
     _value = rhs._value;
+    return *this;
 }
 
 template<typename T>
-literal<T>::literal(const literal<T>&& rhs ):
+literal<T>::literal(literal<T>&& rhs ) noexcept:
     term<T>{rhs},
     _value{std::move(rhs._value)}
 {
 }
 
 template<typename T>
-literal<T>& literal<T>::operator=(const literal<T>&& rhs )
+literal<T>& literal<T>::operator=(literal<T>&& rhs ) noexcept
 {
+    term<T>::operator=(rhs);
     this->_value = std::move(rhs._value);
     return *this;
 }
@@ -508,11 +705,11 @@ bool literal<T>::find_path(path& /*p*/, term<T>& t)
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<typename T>
-function<T>::function(std::string __name, uint32_t __arity, std::vector<std::shared_ptr< term<T>>> __subterms ):
-    term<T>{},
-    _name{__name},
+function<T>::function(std::string __name, uint32_t __arity, std::vector< term_ptr<T> > __subterms ):
+    term<T>{term_kind::function},
+    _name{std::move(__name)},
     _arity{__arity},
-    _subterms{__subterms}
+    _subterms{std::move(__subterms)}
 {}
 
 template<typename T>
@@ -520,6 +717,7 @@ function<T>::function(const function<T>& c ):
     term<T>{c},
     _name{c._name},
     _arity{c._arity},
+    _symbol{c._symbol.load(std::memory_order_relaxed)},
     _subterms{}
 {
     // Remake our subterms as we don't want to point to
@@ -533,32 +731,35 @@ function<T>::function(const function<T>& c ):
 template<typename T>
 function<T>& function<T>::operator=(const function<T>& rhs)
 {
+    term<T>::operator=(rhs);
     _name = rhs._name;
     _arity = rhs._arity;
+    _symbol.store(rhs._symbol.load(std::memory_order_relaxed), std::memory_order_relaxed);
 
-    // Remake our subterms as we don't want to point to
-    // things others are pointing to
-    for(auto& t :rhs._subterms ){
-        _subterms.push_back(term_ptr<T>(t));
-    }
+    // Our old subterms go, we take handles on theirs
+    _subterms = rhs._subterms;
 
     return *this;
 }
 
 template<typename T>
-function<T>::function(const function<T>&& rhs ):
+function<T>::function(function<T>&& rhs ) noexcept:
+    term<T>{rhs},
     _name{std::move(rhs._name)},
     _arity{rhs._arity},
+    _symbol{rhs._symbol.load(std::memory_order_relaxed)},
     _subterms{std::move(rhs._subterms)}
 {
 }
 
 template<typename T>
-function<T>& function<T>::operator=(const function<T>&& rhs )
+function<T>& function<T>::operator=(function<T>&& rhs ) noexcept
 {
-    _name = rhs._name;
+    term<T>::operator=(rhs);
+    _name = std::move(rhs._name);
     _arity = rhs._arity;
-    _subterms = rhs._subterms;
+    _symbol.store(rhs._symbol.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    _subterms = std::move(rhs._subterms);
 
     return *this;
 }
@@ -583,11 +784,15 @@ std::ostream& function<T>::pp(std::ostream& out) const
 template<typename T>
 term_ptr<T> function<T>::rewrite(Sub<T>& sigma)
 {
+    // Build a new node, our subterms may be shared with other terms (rules
+    // especially) so we must not write through them
+    std::vector< term_ptr<T> > subterms;
+    subterms.reserve(_subterms.size());
     for( auto&s : _subterms)
     {
-        s = s->rewrite(sigma);
+        subterms.push_back(s->rewrite(sigma));
     }
-    return this->clone();
+    return make_term<function<T>>(_name, _arity, std::move(subterms));
 }
 
 template<typename T>
@@ -652,9 +857,13 @@ term_iterator<T>::term_iterator(term<T>* __root, bool end , bool reverse):
 template<typename T>
 void term_iterator<T>::_loadpath(term<T>* tptr )
 {
-    // recursively go through our tree in a depth first manner
+    // recursively go through our tree in a depth first manner,
+    // only functions have children worth asking for
     _path.push_back(tptr);
-    for(auto& t: tptr->children()){
+    if( tptr->kind() != term_kind::function ){
+        return;
+    }
+    for(auto& t: static_cast<function<T>*>(tptr)->children()){
         _loadpath(t.get());
     }
 }
@@ -706,20 +915,24 @@ bool unify(term<T>& t1, term<T>& t2, Sub& sigma)
     // Because we can't reflect on which types these terms are,
     // and inherited overloading with virtual functions only applies
     // to the object being called and not to its arguments
-    // we hacked it with virtual functions to do reflection for us
-    if( t1.isVariable() ){
+    // every term carries its kind and we switch on that
+    if( t1.kind() == term_kind::variable ){
         return unify(static_cast<variable<T>&>(t1), t2, sigma);
     }
-    if( t2.isVariable() ){
+    if( t2.kind() == term_kind::variable ){
         return unify(static_cast<variable<T>&>(t2), t1, sigma);
     }
-    if( t1.isLiteral() && t2.isLiteral() ){
-        return ( t1 == t2 );
+    if( t1.kind() != t2.kind() ){
+        return false;
     }
-    if( t1.isFunction() && t2.isFunction() ){
+    switch( t1.kind() ){
+    case term_kind::literal:
+        return unify( static_cast<literal<T>&>(t1), static_cast<literal<T>&>(t2), sigma);
+    case term_kind::function:
         return unify( static_cast<function<T>&>(t1), static_cast<function<T>&>(t2), sigma);
+    default:
+        return false;
     }
-    return false;
 }
 
 template<typename T, typename Sub>
@@ -764,27 +977,96 @@ bool unify( variable<T>& t1, term<T>& t2, Sub& sigma )
     return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Match
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief One way matching, only the variables in the pattern are bound, and a variable
+ * that shows up twice must be bound to equal terms both times
+ * \param term<T>& pattern is the pattern, usually the left hand side of a rule
+ * \param term_ptr<T> t is the term being matched, its subterms are shared into sigma, not copied
+ * \param Sub<T>& sigma is the substitution class for sigma
+ *
+ * \return bool if t is an instance of pattern
+ */
+template<typename T>
+bool match(term<T>& pattern, const term_ptr<T>& t, Sub<T>& sigma)
+{
+    switch( pattern.kind() ){
+    case term_kind::variable:
+    {
+        auto& v = static_cast<variable<T>&>(pattern);
+        if( sigma.contains(v.var()) ){
+            return sigma(v.var()) == *t;
+        }
+        sigma.extend(v.var(), t);
+        return true;
+    }
+    case term_kind::literal:
+        return t->kind() == term_kind::literal &&
+               static_cast<literal<T>&>(pattern) == static_cast<literal<T>&>(*t);
+    case term_kind::function:
+        break;
+    }
+    if( t->kind() != term_kind::function ){
+        return false;
+    }
+    auto& f = static_cast<function<T>&>(pattern);
+    auto& g = static_cast<function<T>&>(*t);
+    if( f.name() != g.name() || f.children().size() != g.children().size() ){
+        return false;
+    }
+    auto it1 = f.children().begin();
+    auto it2 = g.children().begin();
+    for(; it1 != f.children().end(); ++it1, ++it2){
+        if( !match(**it1, *it2, sigma) ){
+            return false;
+        }
+    }
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Reduce
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/*!
+ * \brief the trace that records nothing, see trace.hpp for one that does
+ *
+ * A trace is told when a run begins, is walked down and back up the term with
+ * enter(child number) and leave(), and is told the index of each rule that
+ * fired at the position it has been walked to.
+ */
+struct no_trace
+{
+    static constexpr bool enabled = false;
+    void begin(){}
+    void enter(uint32_t){}
+    void leave(){}
+    void fired(size_t){}
+};
+
 /*!
  * \brief reduces the term by the given rules
  *
  * \param term_ptr<T> t is the term to be reduced
  * \param std::vector<rule<T>& is a set of rules to do the reduction
+ * \param Trace& trace is told each rule that fires and where
  *
  * \return term_ptr<T> a copy of the term now rewritten
  */
-template<typename T>
-term_ptr<T> reduce( const term_ptr<T> t, const std::vector<rule<T>>& rules)
+template<typename T, typename Trace>
+term_ptr<T> reduce( const term_ptr<T> t, const std::vector<rule<T>>& rules, Trace& trace)
 {
     term_ptr<T> ret = t->clone();
+    trace.begin();
     // First unify the term with each rule
 
     // We want to load the sigma with changes, but only once per rule
-    for(auto& r: rules)
+    for(size_t i = 0; i < rules.size(); ++i)
     {
+        auto& r = rules[i];
         Sub<T> sigma;
 
         for(auto& subterm: *ret)
@@ -801,6 +1083,16 @@ term_ptr<T> reduce( const term_ptr<T> t, const std::vector<rule<T>>& rules)
                 path p;
                 ret->find_path(p, subterm);
                 ret = ret->rewrite(r.second, p, sigma);
+
+                for(auto pos: p)
+                {
+                    trace.enter(pos);
+                }
+                trace.fired(i);
+                for(size_t up = 0; up < p.size(); ++up)
+                {
+                    trace.leave();
+                }
                 break;
             }
         }
@@ -809,4 +1101,11 @@ term_ptr<T> reduce( const term_ptr<T> t, const std::vector<rule<T>>& rules)
     return ret;
 }
 
+template<typename T>
+term_ptr<T> reduce( const term_ptr<T> t, const std::vector<rule<T>>& rules)
+{
+    no_trace none;
+    return reduce(t, rules, none);
+}
+
 #endif // TERM_HPP
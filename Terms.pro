@@ -5,6 +5,7 @@
 #-------------------------------------------------
 
 QT       -= core gui
+CONFIG   += c++2a thread
 
 TARGET = Terms
 TEMPLATE = app
@@ -20,12 +21,30 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+# Hold terms through a non-atomic intrusive count rather than std::shared_ptr,
+# terms shared between threads must then be frozen first (see handle.hpp).
+#DEFINES += TERM_INTRUSIVE_REFCOUNT
+
 SOURCES += \
     TermsTest.cpp
 
 HEADERS += \
     Term.hpp \
-    sub.hpp
+    sub.hpp \
+    normalize.hpp \
+    rules.hpp \
+    evaluate.hpp \
+    ac.hpp \
+    unifier.hpp \
+    handle.hpp \
+    scan.hpp \
+    static_rules.hpp \
+    egraph.hpp \
+    bdd.hpp \
+    confluence.hpp \
+    trace.hpp \
+    builder.hpp \
+    steps.hpp
 
 unix {
     target.path = /usr/lib
@@ -1,10 +1,30 @@
 #include "Term.hpp"
 #include "sub.hpp"
+#include "normalize.hpp"
+#include "ac.hpp"
+#include "unifier.hpp"
+#include "scan.hpp"
+#include "static_rules.hpp"
+#include "egraph.hpp"
+#include "bdd.hpp"
+#include "confluence.hpp"
+#include "trace.hpp"
+#include "builder.hpp"
+#include "steps.hpp"
 #include <vector>
 #include <unordered_map>
 #include <iostream>
 #include <memory>
-using namespace std;
+#include <sstream>
+#include <thread>
+#include <set>
+#include <map>
+#include <random>
+// Not the whole of std, std::function would hide our function
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::vector;
 
 // In order to complete this assignment you'll need
 // a term class
@@ -30,41 +50,109 @@ using namespace std;
 // Boolean algebra
 /////////////////////////////////
 
+//builds every node once, in place, and checks the arity of each function
+term_builder<bool> bools{ {"&&", 2}, {"||", 2}, {"!", 1}, {"->", 2} };
+
 //variables in terms
-variable_ptr<bool> b_v() {return make_shared<variable<bool>>(variable<bool>("v"));}
-variable_ptr<bool> b_w() {return make_shared<variable<bool>>(variable<bool>("w"));}
-variable_ptr<bool> b_x() {return make_shared<variable<bool>>(variable<bool>("x"));}
-variable_ptr<bool> b_y() {return make_shared<variable<bool>>(variable<bool>("y"));}
-variable_ptr<bool> b_z() {return make_shared<variable<bool>>(variable<bool>("z"));}
+variable_ptr<bool> b_v() {return bools.var("v");}
+variable_ptr<bool> b_w() {return bools.var("w");}
+variable_ptr<bool> b_x() {return bools.var("x");}
+variable_ptr<bool> b_y() {return bools.var("y");}
+variable_ptr<bool> b_z() {return bools.var("z");}
 
 //literal values
-literal_ptr<bool> b_true() {return make_shared<literal<bool>>(literal<bool>(true));}
-literal_ptr<bool> b_false() {return make_shared<literal<bool>>(literal<bool>(false));}
+literal_ptr<bool> b_true() {return bools.lit(true);}
+literal_ptr<bool> b_false() {return bools.lit(false);}
 
 //functions
 
 function_ptr<bool> b_and(term_ptr<bool> x, term_ptr<bool> y)
 {
-    return make_shared<function<bool>>(function<bool>("&&", 2, {x, y}));
+    return bools.fun("&&", std::move(x), std::move(y));
 }
 function_ptr<bool> b_or(term_ptr<bool> x, term_ptr<bool> y)
 {
-    return make_shared<function<bool>>(function<bool>("||", 2, {x, y}));
+    return bools.fun("||", std::move(x), std::move(y));
 }
 function_ptr<bool> b_not(term_ptr<bool> x)
 {
-    return make_shared<function<bool>>(function<bool>("!", 1, {x}));
+    return bools.fun("!", std::move(x));
 }
 function_ptr<bool> b_arrow(term_ptr<bool> x, term_ptr<bool> y)
 {
-    return make_shared<function<bool>>(function<bool>("->", 2, {x,y}));
+    return bools.fun("->", std::move(x), std::move(y));
 }
 
+//the same symbols for rules fixed at compile time
+struct b_and_sym   { static constexpr const char* name = "&&"; };
+struct b_or_sym    { static constexpr const char* name = "||"; };
+struct b_not_sym   { static constexpr const char* name = "!"; };
+struct b_arrow_sym { static constexpr const char* name = "->"; };
 
 //variables for rules (to make sure there's no overlap)
 //variables for rewrite rules are a and b
-variable_ptr<bool> b_a() {return make_shared<variable<bool>>(variable<bool>("a"));}
-variable_ptr<bool> b_b() {return make_shared<variable<bool>>(variable<bool>("b"));}
+variable_ptr<bool> b_a() {return bools.var("a");}
+variable_ptr<bool> b_b() {return bools.var("b");}
+
+/////////////////////////////////
+// AC matching by labels
+/////////////////////////////////
+
+//every way of labelling the subject's children with a pattern child, how AC
+//nodes used to be matched, kept to check the multiset matcher against
+std::set<std::string> ac_by_labels(const vector<term_ptr<bool>>& pattern, const vector<term_ptr<bool>>& subject)
+{
+    std::set<std::string> found;
+    vector<size_t> label(subject.size(), 0);
+    while( true )
+    {
+        vector<vector<term_ptr<bool>>> parts(pattern.size());
+        for(size_t j = 0; j < subject.size(); ++j)
+        {
+            parts[label[j]].push_back(subject[j]);
+        }
+        std::map<std::string, term_ptr<bool>> sigma;
+        bool ok = true;
+        for(size_t i = 0; ok && i < pattern.size(); ++i)
+        {
+            auto& part = parts[i];
+            if( part.empty() )
+            {
+                ok = false;
+            }
+            else if( pattern[i]->isVariable() )
+            {
+                term_ptr<bool> b = part.size() == 1 ? part[0] : make_term<function<bool>>("&&", part.size(), part);
+                auto seen = sigma.emplace(static_cast<variable<bool>&>(*pattern[i]).var(), b);
+                ok = seen.second || *seen.first->second == *b;
+            }
+            else
+            {
+                ok = part.size() == 1 && *part[0] == *pattern[i];
+            }
+        }
+        if( ok )
+        {
+            std::ostringstream out;
+            for(auto& b: sigma)
+            {
+                out << b.first << " :-> " << *b.second << "; ";
+            }
+            found.insert(out.str());
+        }
+
+        //the next labelling, counting in base pattern.size()
+        size_t j = 0;
+        while( j < label.size() && ++label[j] == pattern.size() )
+        {
+            label[j++] = 0;
+        }
+        if( j == label.size() )
+        {
+            return found;
+        }
+    }
+}
 
 /////////////////////////////////
 // substitution
@@ -80,10 +168,13 @@ int main()
     term_ptr<bool> b2 = b_or(b_and(b_true(), b_x()), b_arrow(b_or(b_v(), b_w()), b_false()));
 
     cout << "print a var b_v" << endl;
-    for(auto &t : *b_v()){
+    // Hold on to them, the range only keeps the term alive, not the pointer to it
+    term_ptr<bool> v = b_v();
+    term_ptr<bool> t0 = b_true();
+    for(auto &t : *v){
         cout << t << endl;
     }
-    for(auto &t : *b_true()){
+    for(auto &t : *t0){
         cout << t << endl;
     }
 
@@ -139,5 +230,322 @@ int main()
     cout << "Now reduce b2 with contra" << endl;
     cout << *b2 << endl;
     cout << *reduce( b2, rules ) << endl;
+
+    // ||(a, false) => a and &&(true, a) => a
+    rules.push_back(make_pair(b_or(b_a(), b_false()), b_a()));
+    rules.push_back(make_pair(b_and(b_true(), b_a()), b_a()));
+    cout << "Now normalize b2" << endl;
+    term_ptr<bool> b2n = normalize( b2, rules );
+    cout << *b2n << endl;
+
+    // Edit the normal form and only renormalize what changed
+    Sub<bool> empty;
+    term_ptr<bool> b2e = b2n->rewrite(b_false(), {2}, empty);
+    cout << "Edited " << *b2e << endl;
+    cout << "Renormalized " << *renormalize( b2e, rules ) << endl;
+
+    // A counter ticking down, every step a rewrite at the root
+    term_builder<int> ints;
+    rule_set<int> ticks;
+    arithmetic_evaluators(ticks.natives());
+    ticks.add(make_pair(term_ptr<int>(ints.fun("count", ints.var("a"))),
+                        term_ptr<int>(ints.fun("count", ints.fun("-", ints.var("a"), ints.lit(1))))), 0,
+              {satisfies<int>("a", [](term<int>& n){ return n.isLiteral() && static_cast<literal<int>&>(n).value() > 0; })});
+    ticks.add(make_pair(term_ptr<int>(ints.fun("count", ints.lit(0))), term_ptr<int>(ints.lit(0))));
+    cout << "Counted down to " << *normalize<int>(ints.fun("count", ints.lit(1000000)), ticks) << endl;
+
+    // Guarded rules in place of &&(a, true) => a and &&(a, false) => false,
+    // ahead of the plain rules
+    rule_set<bool> guarded(rules);
+    guarded.add(make_pair(b_and(b_a(), b_b()), b_a()), 1, {literal_is<bool>("b", true)});
+    guarded.add(make_pair(b_and(b_a(), b_b()), b_false()), 1, {literal_is<bool>("b", false)});
+    // c isn't bound by &&(a, b), so this guard is false and the rule never fires
+    guarded.add(make_pair(b_and(b_a(), b_b()), b_true()), 2, {is_literal<bool>("c")});
+    cout << "Normalize b1 with guarded rules" << endl;
+    cout << *b1 << endl;
+    cout << *normalize( b1, guarded ) << endl;
+
+    // Ground subterms fold straight to literals
+    rule_set<bool> folding;
+    boolean_evaluators(folding.natives());
+    term_ptr<bool> b3 = b_or(b_and(b_true(), b_false()), b_arrow(b_false(), b_x()));
+    cout << "Fold " << *b3 << endl;
+    cout << *normalize( b3, folding ) << endl;
+
+    // With && and || declared AC, &&(a, false) => false covers every
+    // permutation and nesting of false under an &&
+    ac_rules<bool> ac({"&&", "||"});
+    ac.add(make_pair(b_and(b_a(), b_false()), b_false()));
+    ac.add(make_pair(b_or(b_a(), b_false()), b_a()));
+    term_ptr<bool> b4 = b_or(b_and(b_y(), b_and(b_false(), b_x())), b_or(b_z(), b_false()));
+    cout << "Flatten " << *b4 << endl;
+    cout << *ac.flatten(b4) << endl;
+    cout << *normalize( b4, ac ) << endl;
+
+    // &&(a, a) => a halves every count, 24 children are shared out by count, not one by one
+    ac_rules<bool> idem({"&&"});
+    idem.add(make_pair(b_and(b_a(), b_a()), b_a()));
+    vector<term_ptr<bool>> pairs;
+    for(int i = 0; i < 24; ++i)
+    {
+        pairs.push_back(bools.var(std::string(1, char('p' + i / 4))));
+    }
+    term_ptr<bool> doubled = idem.flatten(make_term<function<bool>>("&&", pairs.size(), std::move(pairs)));
+    cout << "Halve " << *doubled << endl;
+    cout << *normalize( doubled, idem ) << endl;
+
+    // Every match the multiset matcher finds against labelling every child, on
+    // random flat patterns and subjects, and the substitution is left as it was
+    std::mt19937 rng(7);
+    ac_rules<bool> by_count({"&&"});
+    size_t cases = 300, agree = 0;
+    for(size_t c = 0; c < cases; ++c)
+    {
+        vector<term_ptr<bool>> subject, pattern;
+        for(size_t j = 1 + rng() % 6; j > 0; --j)
+        {
+            size_t r = rng() % 4;
+            subject.push_back(r < 3 ? term_ptr<bool>(bools.var(std::string(1, char('x' + r)))) : term_ptr<bool>(b_false()));
+        }
+        for(size_t i = 1 + rng() % 4; i > 0; --i)
+        {
+            size_t r = rng() % 5;
+            pattern.push_back(r < 4 ? term_ptr<bool>(bools.var(std::string(1, "abca"[r]))) : term_ptr<bool>(b_false()));
+        }
+        term_ptr<bool> t = by_count.flatten(make_term<function<bool>>("&&", subject.size(), subject));
+        term_ptr<bool> p = make_term<function<bool>>("&&", pattern.size(), pattern);
+
+        std::set<std::string> found;
+        Sub<bool> sigma;
+        by_count.match(*p, t, sigma, [&found](Sub<bool>& s){
+            std::ostringstream out;
+            for(std::string name: {"a", "b", "c"})
+            {
+                if( s.contains(name) )
+                {
+                    out << name << " :-> " << s(name) << "; ";
+                }
+            }
+            found.insert(out.str());
+            return false;
+        });
+        agree += found == ac_by_labels(pattern, t->children()) && sigma.begin() == sigma.end();
+    }
+    cout << "AC matches agree with labelling on " << agree << " of " << cases << " random cases" << endl;
+
+    // Two way unification, ->(a, false) with ->(||(v, w), b)
+    unifier<bool> u;
+    term_ptr<bool> lhs = b_arrow(b_a(), b_false());
+    term_ptr<bool> other = b_arrow(b_or(b_v(), b_w()), b_b());
+    cout << "Unify " << *lhs << " with " << *other << "? " << u.unify(lhs, other) << endl;
+    cout << *u.resolve(lhs) << endl;
+    u.substitution().print();
+
+    // Flatten b2 and only match where the symbol is a rule head
+    rule_heads<bool> heads(rules);
+    flat_term<bool> flat(b2);
+    cout << "Redexes in " << *b2 << " (" << scan_level() << ")" << endl;
+    for(auto& r: redexes(flat, rules, heads))
+    {
+        cout << *flat.node(r.first) << " by rule " << r.second << endl;
+    }
+
+    // Every kernel the CPU can run finds the same positions as the plain loop,
+    // at lengths that leave the vector loops a tail, or nothing but one
+    vector<uint32_t> wanted{2, 5, 7};
+    bool kernels_agree = true;
+    for(size_t n: {0, 1, 7, 8, 9, 31, 1003})
+    {
+        vector<uint32_t> symbols(n);
+        for(size_t i = 0; i < n; ++i)
+        {
+            symbols[i] = (i * 7919 + n) % 11;
+        }
+        vector<uint32_t> plain(n), vectored(n);
+        plain.resize(scan_scalar(symbols.data(), n, wanted.data(), wanted.size(), plain.data()));
+#ifdef TERM_SCAN_X86
+        vector<scan_kernel> kernels;
+        if( __builtin_cpu_supports("sse2") )
+        {
+            kernels.push_back(scan_sse2);
+        }
+        if( __builtin_cpu_supports("avx2") )
+        {
+            kernels.push_back(scan_avx2);
+        }
+        for(auto kernel: kernels)
+        {
+            vectored.assign(n, 0);
+            vectored.resize(kernel(symbols.data(), n, wanted.data(), wanted.size(), vectored.data()));
+            kernels_agree = kernels_agree && vectored == plain;
+        }
+#endif
+    }
+    cout << "Scan kernels agree? " << kernels_agree << endl;
+
+    // The first three rules again, fixed at compile time
+    typedef static_rules<
+        static_rule< pfun<b_arrow_sym, pvar<'a'>, plit<false>>, pfun<b_not_sym, pvar<'a'>> >,
+        static_rule< pfun<b_or_sym, pvar<'a'>, plit<false>>, pvar<'a'> >,
+        static_rule< pfun<b_and_sym, plit<true>, pvar<'a'>>, pvar<'a'> >
+    > fixed_rules;
+    cout << "Normalize b2 with fixed rules" << endl;
+    cout << *normalize( b2, fixed_rules() ) << endl;
+    cout << "Same as dynamic? " << (*normalize( b2, fixed_rules() ) == *normalize( b2, fixed_rules::dynamic<bool>() )) << endl;
+
+    // Commutativity would never stop under reduce or normalize, in an e-graph it's fine
+    vector<rule<bool>> comm;
+    comm.push_back(make_pair(b_and(b_a(), b_false()), b_false()));
+    comm.push_back(make_pair(b_or(b_false(), b_a()), b_a()));
+    comm.push_back(make_pair(b_and(b_a(), b_b()), b_and(b_b(), b_a())));
+    comm.push_back(make_pair(b_or(b_a(), b_b()), b_or(b_b(), b_a())));
+    egraph<bool> eg;
+    auto root = eg.add(b1);
+    size_t rounds = eg.saturate(comm);
+    cout << "Saturate " << *b1 << " in " << rounds << " rounds, "
+         << eg.nodes() << " nodes in " << eg.classes() << " classes" << endl;
+    cout << *eg.extract(root) << endl;
+
+    // b2 and its normal form are the same function, so the same BDD
+    bdd diagrams;
+    cout << "Canonical " << *b2 << endl;
+    cout << *diagrams.canonicalize(*b2) << endl;
+    cout << "Equivalent to its normal form? " << diagrams.equivalent(*b2, *normalize( b2, rules )) << endl;
+
+    // &&(true, a) and &&(a, false) overlap on &&(true, false), both give false
+    vector<rule<bool>> overlapping = rules;
+    overlapping.push_back(make_pair(b_and(b_a(), b_false()), b_false()));
+    confluence<bool> check(overlapping);
+    for(auto& cp: check.critical_pairs())
+    {
+        cout << "Critical pair of rules " << cp.outer << " and " << cp.inner << " on " << *cp.peak
+             << ": " << *cp.left << " and " << *cp.right << (cp.joinable ? " join" : " don't join") << endl;
+    }
+    cout << "Locally confluent? " << check.locally_confluent() << endl;
+
+    // De Morgan overlaps &&(true, a) below the root, and the pair only joins once !(true) reduces
+    vector<rule<bool>> de_morgan;
+    de_morgan.push_back(make_pair(b_not(b_and(b_a(), b_b())), b_or(b_not(b_a()), b_not(b_b()))));
+    de_morgan.push_back(make_pair(b_and(b_true(), b_a()), b_a()));
+    for(auto& cp: confluence<bool>(de_morgan).critical_pairs())
+    {
+        cout << "Critical pair on " << *cp.peak << ": " << *cp.left << " and " << *cp.right
+             << (cp.joinable ? " join" : " don't join") << endl;
+    }
+    de_morgan.push_back(make_pair(b_not(b_true()), b_false()));
+    de_morgan.push_back(make_pair(b_or(b_false(), b_a()), b_a()));
+    cout << "With !(true) and ||(false, a), locally confluent? " << confluence<bool>(de_morgan).locally_confluent() << endl;
+
+    // Trace normalizing b2, then rebuild each step from the trace alone
+    std::stringstream recorded;
+    {
+        trace_log log(recorded);
+        normalize( b2, rules, log.writer() );
+    }
+    cout << "Replay " << *b2 << endl;
+    for(auto& run: read_trace(recorded))
+    {
+        replay(b2, rules, run, [](const trace_step& s, const term_ptr<bool>& t){
+            cout << "step " << s.step << " rule " << s.rule << ": " << *t << endl;
+        });
+    }
+
+    // 70 nots over &&(true, x), the position of the first step is 70 deep
+    vector<rule<bool>> nots;
+    nots.push_back(make_pair(b_not(b_not(b_a())), b_a()));
+    nots.push_back(make_pair(b_and(b_true(), b_a()), b_a()));
+    term_ptr<bool> deep = b_and(b_true(), b_x());
+    for(int i = 0; i < 70; ++i)
+    {
+        deep = b_not(deep);
+    }
+    std::stringstream deep_recorded;
+    {
+        trace_log log(deep_recorded);
+        normalize( deep, nots, log.writer() );
+    }
+    for(auto& run: read_trace(deep_recorded))
+    {
+        cout << "Replayed 70 nots to " << *replay(deep, nots, run, [](const trace_step&, const term_ptr<bool>&){}) << endl;
+    }
+
+    // AC rewriting traces too, flattening shows up as a fold
+    std::stringstream ac_recorded;
+    {
+        trace_log log(ac_recorded);
+        normalize( b4, ac, log.writer() );
+    }
+    cout << "Trace " << *b4 << " modulo AC" << endl;
+    for(auto& run: read_trace(ac_recorded))
+    {
+        for(auto& s: run)
+        {
+            cout << "step " << s.step << (s.rule == trace_fold ? " flatten" : " rule " + std::to_string(s.rule))
+                 << " at depth " << s.at.size() << endl;
+        }
+    }
+
+    // Frozen, two threads build on the one term, and keep it after the freeze is gone
+    term_ptr<bool> shared = normalize<bool>(b_arrow(b_or(b_v(), b_w()), b_false()), rules);
+    vector<term_ptr<bool>> built(2);
+    {
+        frozen<bool> published(shared);
+        vector<std::thread> pool;
+        for(size_t i = 0; i < built.size(); ++i)
+        {
+            pool.emplace_back([&, i](){ built[i] = renormalize<bool>(b_or(published.get(), b_false()), rules); });
+        }
+        for(auto& t: pool)
+        {
+            t.join();
+        }
+    }
+    shared.reset();
+    for(auto& t: built)
+    {
+        cout << "Built on frozen " << *t << endl;
+    }
+
+    // The builder knows -> takes two
+    try
+    {
+        bools.fun("->", b_x());
+    }
+    catch(InvalidArityException& e)
+    {
+        cout << e.what() << endl;
+    }
+
+#ifdef TERM_COROUTINES
+    // The same normalization as above, a step at a time
+    cout << "Steps of " << *b2 << endl;
+    auto stepper = steps(b2, rules);
+    for(auto& s: stepper)
+    {
+        cout << "rule " << s.rule << ": " << *s.term << endl;
+    }
+    cout << *stepper.result() << endl;
+
+    // Pausing every 3 nodes too, a pause isn't a step
+    auto paced = steps(b2, rules, 3);
+    size_t taken = 0, pauses = 0;
+    while( paced.resume() )
+    {
+        ++(paced.paused() ? pauses : taken);
+    }
+    cout << taken << " steps and " << pauses << " pauses to " << *paced.result() << endl;
+
+    // Many at once, taking turns a step at a time on two threads
+    step_scheduler<bool, vector<rule<bool>>> scheduler(rules, 2, 1, 4);
+    vector<std::future<term_ptr<bool>>> pending;
+    for(int i = 0; i < 4; ++i)
+    {
+        pending.push_back(scheduler.submit(b_or(b_and(b_true(), b_x()), b_arrow(b_or(b_v(), b_w()), b_false()))));
+    }
+    for(auto& p: pending)
+    {
+        cout << "Scheduled " << *p.get() << endl;
+    }
+#endif
     return 0;
 }
@@ -0,0 +1,651 @@
+#ifndef AC_HPP
+#define AC_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <numeric>
+#include <algorithm>
+#include <unordered_set>
+#include "Term.hpp"
+
+/**
+ * Associative-commutative symbols.
+ *
+ * A function symbol declared AC is stored flattened and sorted, so
+ * &&(x, &&(false, y)) is kept as &&(false, x, y). Once both sides are in this
+ * canonical form, equality modulo AC is plain structural equality.
+ *
+ * Matching an AC node treats its children as a multiset. The pattern's
+ * non-variable children are placed on distinct subject children first, a
+ * bipartite matching on their head symbols throws out impossible cases before
+ * any backtracking, and then what is left is shared out between the pattern's
+ * variables. The sharing works on multisets: equal subject children are counted
+ * rather than told apart, a variable that shows up n times takes n copies of its
+ * share, and counts that can't be split that way are thrown out up front. A variable that takes more than one child is bound to a new node
+ * of the same symbol holding them, so &&(false, a) matches &&(false, x, y)
+ * with a :-> &&(x, y).
+ *
+ * Matching is done with continuations so a choice made inside one AC node can
+ * still be undone if a later part of the pattern fails, a non-linear variable
+ * for instance. There is one substitution for the whole match, a binding is
+ * erased again when the choice that made it is backed out of.
+ */
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Ordering
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief total order on terms: literals, then variables, then functions
+ *
+ * \return int less than, equal to, or greater than 0, like strcmp
+ */
+template<typename T>
+int compare(term<T>& a, term<T>& b)
+{
+    auto rank = [](term<T>& t){ return t.isLiteral() ? 0 : t.isVariable() ? 1 : 2; };
+    if( rank(a) != rank(b) )
+    {
+        return rank(a) - rank(b);
+    }
+    if( a.isLiteral() )
+    {
+        auto& x = static_cast<literal<T>&>(a).value();
+        auto& y = static_cast<literal<T>&>(b).value();
+        return x < y ? -1 : y < x ? 1 : 0;
+    }
+    if( a.isVariable() )
+    {
+        return static_cast<variable<T>&>(a).var().compare(static_cast<variable<T>&>(b).var());
+    }
+    auto& f = static_cast<function<T>&>(a);
+    auto& g = static_cast<function<T>&>(b);
+    if( int c = f.name().compare(g.name()) )
+    {
+        return c;
+    }
+    if( f.children().size() != g.children().size() )
+    {
+        return f.children().size() < g.children().size() ? -1 : 1;
+    }
+    for(size_t i = 0; i < f.children().size(); ++i)
+    {
+        if( int c = compare(*f.children()[i], *g.children()[i]) )
+        {
+            return c;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// ac_rules
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+class ac_rules
+{
+public:
+    typedef std::function<bool(Sub<T>&)> next;
+
+    ac_rules(std::vector<std::string> symbols = {}):
+        _symbols{symbols.begin(), symbols.end()}
+    {}
+
+    void declare(std::string name){ _symbols.insert(name); }
+    bool is_ac(const std::string& name) const { return _symbols.count(name) != 0; }
+
+    /*!
+     * \brief adds a rule, its left hand side is flattened so it can be matched modulo AC
+     */
+    void add(rule<T> r)
+    {
+        if( !r.first || !r.second )
+        {
+            throw InvalidRuleException();
+        }
+        _rules.push_back(std::make_pair(flatten(r.first), r.second));
+    }
+
+    /*!
+     * \brief puts every AC node in t into flattened, sorted form
+     */
+    term_ptr<T> flatten(const term_ptr<T>& t) const
+    {
+        if( !t->isFunction() )
+        {
+            return t;
+        }
+        auto& f = static_cast<function<T>&>(*t);
+        std::vector< term_ptr<T> > subterms;
+        subterms.reserve(f.children().size());
+        bool changed = false;
+        for(auto& c: f.children())
+        {
+            subterms.push_back(flatten(c));
+            changed = changed || subterms.back() != c;
+        }
+        term_ptr<T> ret = changed ? make_term<function<T>>(f.name(), f.arity(), std::move(subterms)) : t;
+        return flatten_root(ret);
+    }
+
+    /*!
+     * \brief matches pattern against t modulo AC, t must already be flattened
+     *
+     * \return bool if t is an instance of pattern, sigma holds the first match found
+     */
+    bool match(term<T>& pattern, const term_ptr<T>& t, Sub<T>& sigma) const
+    {
+        return _match(pattern, t, sigma, [](Sub<T>&){ return true; });
+    }
+
+    /*!
+     * \brief calls k with each match of pattern against t in turn, until k returns true
+     *
+     * \return bool if k returned true, sigma then holds that match, otherwise it's left as it was
+     */
+    bool match(term<T>& pattern, const term_ptr<T>& t, Sub<T>& sigma, const next& k) const
+    {
+        return _match(pattern, t, sigma, k);
+    }
+
+    /*!
+     * \brief flattens the root of t if it needs it, otherwise tries each rule in order
+     * \param term_ptr<T> t is the term to rewrite, its children already flattened
+     * \param term_ptr<T>& out gets the flattened node, or the instantiated right hand side
+     * \param size_t& fired gets the index of the rule that matched, or flattened
+     *
+     * \return bool if anything changed
+     */
+    bool apply(const term_ptr<T>& t, term_ptr<T>& out, size_t& fired) const
+    {
+        term_ptr<T> flat = flatten_root(t);
+        if( flat != t )
+        {
+            out = flat;
+            fired = flattened;
+            return true;
+        }
+        for(size_t i = 0; i < _rules.size(); ++i)
+        {
+            Sub<T> sigma;
+            if( match(*_rules[i].first, t, sigma) )
+            {
+                out = _rules[i].second->rewrite(sigma);
+                fired = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool apply(const term_ptr<T>& t, term_ptr<T>& out) const
+    {
+        size_t fired;
+        return apply(t, out, fired);
+    }
+
+    // What apply says fired when it flattened the root, a trace shows it as a fold
+    static constexpr size_t flattened = size_t(-1);
+
+private:
+    /*!
+     * \brief splices same symbol children into an AC node and sorts them,
+     * the children are assumed flattened already
+     */
+    term_ptr<T> flatten_root(const term_ptr<T>& t) const
+    {
+        if( !t->isFunction() || !is_ac(static_cast<function<T>&>(*t).name()) )
+        {
+            return t;
+        }
+        auto& f = static_cast<function<T>&>(*t);
+        std::vector< term_ptr<T> > subterms;
+        bool changed = false;
+        for(auto& c: f.children())
+        {
+            if( c->isFunction() && static_cast<function<T>&>(*c).name() == f.name() )
+            {
+                auto& inner = c->children();
+                subterms.insert(subterms.end(), inner.begin(), inner.end());
+                changed = true;
+            }
+            else
+            {
+                subterms.push_back(c);
+            }
+        }
+        auto less = [](const term_ptr<T>& a, const term_ptr<T>& b){ return compare(*a, *b) < 0; };
+        if( !changed && std::is_sorted(subterms.begin(), subterms.end(), less) )
+        {
+            return t;
+        }
+        std::stable_sort(subterms.begin(), subterms.end(), less);
+        return make_term<function<T>>(f.name(), subterms.size(), std::move(subterms));
+    }
+
+    bool _match(term<T>& p, const term_ptr<T>& t, Sub<T>& sigma, const next& k) const
+    {
+        if( p.isVariable() )
+        {
+            auto& v = static_cast<variable<T>&>(p);
+            if( sigma.contains(v.var()) )
+            {
+                return sigma(v.var()) == *t && k(sigma);
+            }
+            sigma.extend(v.var(), t);
+            if( k(sigma) )
+            {
+                return true;
+            }
+            sigma.erase(v.var());
+            return false;
+        }
+        if( p.isLiteral() )
+        {
+            return p == *t && k(sigma);
+        }
+        if( !t->isFunction() )
+        {
+            return false;
+        }
+        auto& f = static_cast<function<T>&>(p);
+        auto& g = static_cast<function<T>&>(*t);
+        if( f.name() != g.name() )
+        {
+            return false;
+        }
+        if( is_ac(f.name()) )
+        {
+            return _match_ac(f, g, sigma, k);
+        }
+        if( f.children().size() != g.children().size() )
+        {
+            return false;
+        }
+        return _match_list(f.children(), g.children(), 0, sigma, k);
+    }
+
+    bool _match_list(std::vector< term_ptr<T> >& ps, std::vector< term_ptr<T> >& ts, size_t i,
+                     Sub<T>& sigma, const next& k) const
+    {
+        if( i == ps.size() )
+        {
+            return k(sigma);
+        }
+        return _match(*ps[i], ts[i], sigma, [&](Sub<T>& s){ return _match_list(ps, ts, i+1, s, k); });
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Multiset matching
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+
+    struct ac_state
+    {
+        const std::string& name;
+        std::vector< term_ptr<T> > rigid;
+        std::vector< term_ptr<T> > vars;
+        std::vector< term_ptr<T> >& subject;
+        std::vector<bool> used;
+    };
+
+    bool _match_ac(function<T>& p, function<T>& s, Sub<T>& sigma, const next& k) const
+    {
+        ac_state st{s.name(), {}, {}, s.children(), std::vector<bool>(s.children().size(), false)};
+        for(auto& c: p.children())
+        {
+            (c->isVariable() ? st.vars : st.rigid).push_back(c);
+        }
+
+        // Every pattern child takes at least one subject child, and without
+        // variables to soak up the rest the counts must agree
+        if( st.subject.size() < p.children().size() || (st.vars.empty() && st.subject.size() != st.rigid.size()) )
+        {
+            return false;
+        }
+        if( !_can_place(st) )
+        {
+            return false;
+        }
+        return _match_rigid(st, 0, sigma, k);
+    }
+
+    /*!
+     * \brief could the pattern child go on the subject child, going by head symbol only
+     */
+    bool _compatible(term<T>& p, term<T>& s) const
+    {
+        if( p.isLiteral() )
+        {
+            return p == s;
+        }
+        if( !s.isFunction() )
+        {
+            return false;
+        }
+        auto& f = static_cast<function<T>&>(p);
+        auto& g = static_cast<function<T>&>(s);
+        if( f.name() != g.name() )
+        {
+            return false;
+        }
+        return is_ac(f.name()) ? g.children().size() >= f.children().size()
+                               : g.children().size() == f.children().size();
+    }
+
+    /*!
+     * \brief bipartite matching of the rigid pattern children onto the subject,
+     * if they can't all be placed at once there's no point backtracking
+     */
+    bool _can_place(ac_state& st) const
+    {
+        const size_t n = st.rigid.size(), m = st.subject.size();
+        std::vector< std::vector<size_t> > edges(n);
+        for(size_t i = 0; i < n; ++i)
+        {
+            for(size_t j = 0; j < m; ++j)
+            {
+                if( _compatible(*st.rigid[i], *st.subject[j]) )
+                {
+                    edges[i].push_back(j);
+                }
+            }
+            if( edges[i].empty() )
+            {
+                return false;
+            }
+        }
+
+        // Kuhn's augmenting paths
+        std::vector<long> owner(m, -1);
+        std::function<bool(size_t, std::vector<bool>&)> augment = [&](size_t i, std::vector<bool>& seen)
+        {
+            for(auto j: edges[i])
+            {
+                if( seen[j] )
+                {
+                    continue;
+                }
+                seen[j] = true;
+                if( owner[j] < 0 || augment(owner[j], seen) )
+                {
+                    owner[j] = i;
+                    return true;
+                }
+            }
+            return false;
+        };
+        for(size_t i = 0; i < n; ++i)
+        {
+            std::vector<bool> seen(m, false);
+            if( !augment(i, seen) )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool _match_rigid(ac_state& st, size_t i, Sub<T>& sigma, const next& k) const
+    {
+        if( i == st.rigid.size() )
+        {
+            return _match_vars(st, sigma, k);
+        }
+        for(size_t j = 0; j < st.subject.size(); ++j)
+        {
+            // Equal children sit next to each other, trying the second of a
+            // pair when the first was free gives nothing new
+            if( st.used[j] || (j > 0 && !st.used[j-1] && *st.subject[j] == *st.subject[j-1]) )
+            {
+                continue;
+            }
+            if( !_compatible(*st.rigid[i], *st.subject[j]) )
+            {
+                continue;
+            }
+            st.used[j] = true;
+            bool found = _match(*st.rigid[i], st.subject[j], sigma,
+                                [&](Sub<T>& s){ return _match_rigid(st, i+1, s, k); });
+            st.used[j] = false;
+            if( found )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*!
+     * \brief takes one copy of t out of the unused subject children
+     */
+    bool _take(ac_state& st, term<T>& t, std::vector<size_t>& taken) const
+    {
+        for(size_t j = 0; j < st.subject.size(); ++j)
+        {
+            if( !st.used[j] && *st.subject[j] == t )
+            {
+                st.used[j] = true;
+                taken.push_back(j);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool _match_vars(ac_state& st, Sub<T>& sigma, const next& k) const
+    {
+        // Variables already bound have to find their binding among what's left
+        std::vector<size_t> taken;
+        std::vector< term_ptr<T> > open;
+        bool ok = true;
+        for(auto& v: st.vars)
+        {
+            std::string name = static_cast<variable<T>&>(*v).var();
+            if( !sigma.contains(name) )
+            {
+                open.push_back(v);
+                continue;
+            }
+            term<T>& b = sigma(name);
+            if( b.isFunction() && static_cast<function<T>&>(b).name() == st.name )
+            {
+                for(auto& c: b.children())
+                {
+                    ok = ok && _take(st, *c, taken);
+                }
+            }
+            else
+            {
+                ok = ok && _take(st, b, taken);
+            }
+        }
+
+        std::vector< term_ptr<T> > rest;
+        for(size_t j = 0; j < st.subject.size(); ++j)
+        {
+            if( !st.used[j] )
+            {
+                rest.push_back(st.subject[j]);
+            }
+        }
+        for(auto j: taken)
+        {
+            st.used[j] = false;
+        }
+
+        if( !ok || rest.size() < open.size() || (open.empty() && !rest.empty()) )
+        {
+            return false;
+        }
+        if( open.empty() )
+        {
+            return k(sigma);
+        }
+
+        // Open variables by name, a variable that shows up n times takes n
+        // copies of everything in its share
+        ac_share sh;
+        for(auto& v: open)
+        {
+            const std::string& name = static_cast<variable<T>&>(*v).var();
+            auto seen = std::find(sh.names.begin(), sh.names.end(), name);
+            if( seen == sh.names.end() )
+            {
+                sh.names.push_back(name);
+                sh.times.push_back(1);
+            }
+            else
+            {
+                ++sh.times[seen - sh.names.begin()];
+            }
+        }
+
+        // The rest by multiplicity, equal children sit next to each other
+        for(auto& r: rest)
+        {
+            if( !sh.distinct.empty() && *sh.distinct.back() == *r )
+            {
+                ++sh.count.back();
+            }
+            else
+            {
+                sh.distinct.push_back(r);
+                sh.count.push_back(1);
+            }
+        }
+
+        // Every copy goes out in lots of some variable's times, so each count
+        // has to be a multiple of their gcd
+        size_t g = 0;
+        for(auto n: sh.times)
+        {
+            g = std::gcd(g, n);
+        }
+        if( std::any_of(sh.count.begin(), sh.count.end(), [g](size_t n){ return n % g != 0; }) )
+        {
+            return false;
+        }
+
+        sh.after.assign(sh.distinct.size() + 1, 0);
+        for(size_t i = sh.distinct.size(); i > 0; --i)
+        {
+            sh.after[i-1] = sh.after[i] + sh.count[i-1];
+        }
+        sh.take.assign(sh.names.size(), std::vector<size_t>(sh.distinct.size(), 0));
+        sh.size.assign(sh.names.size(), 0);
+        return _share(st, sh, 0, 0, sh.count[0], sigma, k);
+    }
+
+    /*!
+     * \brief what's left of an AC subject, to be shared out between the open variables
+     */
+    struct ac_share
+    {
+        std::vector<std::string> names;             // the open variables
+        std::vector<size_t> times;                  // how often each is in the pattern
+        std::vector< term_ptr<T> > distinct;        // the subject children left, each once
+        std::vector<size_t> count;                  // and how many of each
+        std::vector<size_t> after;                  // how many children from distinct[i] on
+        std::vector< std::vector<size_t> > take;    // names[v] gets take[v][i] copies of distinct[i]
+        std::vector<size_t> size;                   // how many children names[v] has so far
+    };
+
+    /*!
+     * \brief shares out the left copies of distinct[i], from variable v on
+     *
+     * Each share is a multiset, so it is chosen as a count of each distinct
+     * child rather than child by child, and no two ways of sharing out give
+     * the same bindings.
+     */
+    bool _share(ac_state& st, ac_share& sh, size_t i, size_t v, size_t left, Sub<T>& sigma, const next& k) const
+    {
+        if( v + 1 == sh.names.size() )
+        {
+            // The last variable takes whatever is left, if it divides
+            if( left % sh.times[v] != 0 )
+            {
+                return false;
+            }
+            sh.take[v][i] = left / sh.times[v];
+            sh.size[v] += sh.take[v][i];
+            bool found = _shared(st, sh, i + 1, sigma, k);
+            sh.size[v] -= sh.take[v][i];
+            return found;
+        }
+        for(size_t x = left / sh.times[v] + 1; x-- > 0; )
+        {
+            sh.take[v][i] = x;
+            sh.size[v] += x;
+            bool found = _share(st, sh, i, v + 1, left - x * sh.times[v], sigma, k);
+            sh.size[v] -= x;
+            if( found )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*!
+     * \brief distinct[0..i) are shared out, on to distinct[i] or, once they all are, to k
+     */
+    bool _shared(ac_state& st, ac_share& sh, size_t i, Sub<T>& sigma, const next& k) const
+    {
+        // Every variable still empty needs at least one of each of its copies from what's left
+        size_t need = 0;
+        for(size_t v = 0; v < sh.names.size(); ++v)
+        {
+            need += sh.size[v] ? 0 : sh.times[v];
+        }
+        if( need > sh.after[i] )
+        {
+            return false;
+        }
+        if( i < sh.distinct.size() )
+        {
+            return _share(st, sh, i, 0, sh.count[i], sigma, k);
+        }
+
+        for(size_t v = 0; v < sh.names.size(); ++v)
+        {
+            std::vector< term_ptr<T> > part;
+            part.reserve(sh.size[v]);
+            for(size_t j = 0; j < sh.distinct.size(); ++j)
+            {
+                part.insert(part.end(), sh.take[v][j], sh.distinct[j]);
+            }
+            term_ptr<T> b = part.size() == 1 ? part.front()
+                          : make_term<function<T>>(st.name, part.size(), std::move(part));
+            sigma.extend(sh.names[v], b);
+        }
+        if( k(sigma) )
+        {
+            return true;
+        }
+        for(auto& name: sh.names)
+        {
+            sigma.erase(name);
+        }
+        return false;
+    }
+
+    std::unordered_set<std::string> _symbols;
+    std::vector<rule<T>> _rules;
+};
+
+template<typename T>
+bool apply(const ac_rules<T>& rules, const term_ptr<T>& t, term_ptr<T>& out, size_t& fired)
+{
+    return rules.apply(t, out, fired);
+}
+
+template<typename T>
+bool apply(const ac_rules<T>& rules, const term_ptr<T>& t, term_ptr<T>& out)
+{
+    return rules.apply(t, out);
+}
+
+#endif // AC_HPP
@@ -0,0 +1,342 @@
+#ifndef BDD_HPP
+#define BDD_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include "Term.hpp"
+
+/**
+ * Reduced ordered binary decision diagrams for term<bool>.
+ *
+ * Two boolean terms are equivalent exactly when they turn into the same BDD
+ * node, so equivalence is a comparison of ids, and turning a BDD back into a
+ * term gives a canonical form that can be handed to the rules afterwards.
+ *
+ * Every node is made through the unique table, so there is only ever one node
+ * for each (variable, low, high), and every operation goes through ite() and
+ * its cache. Variables are ordered as they are first seen unless order() is
+ * called first.
+ *
+ * Nodes are kept alive by ref()/deref(), and gc() frees everything not reachable
+ * from a referenced node, so an id that isn't held by ref() may be reused after
+ * it. It only runs between top level calls, never in the middle of one, so the
+ * intermediate results of an operation are safe.
+ */
+class bdd
+{
+public:
+    typedef uint32_t id;
+    static constexpr id zero = 0;
+    static constexpr id one = 1;
+
+    bdd(size_t gc_threshold = 1 << 20):
+        _gc_threshold{gc_threshold}
+    {
+        // The two terminals, their level is past every variable
+        _nodes.push_back(node{terminal, zero, zero});
+        _nodes.push_back(node{terminal, one, one});
+        _refs.assign(2, 1);
+    }
+
+    /*!
+     * \brief fixes the variable order, earlier names are nearer the root
+     */
+    void order(const std::vector<std::string>& names)
+    {
+        for(auto& name: names)
+        {
+            _level(name);
+        }
+    }
+
+    id var(const std::string& name)
+    {
+        return _make(_level(name), zero, one);
+    }
+
+    id ite(id f, id g, id h)
+    {
+        // The terminal cases
+        if( f == one ) return g;
+        if( f == zero ) return h;
+        if( g == h ) return g;
+        if( g == one && h == zero ) return f;
+
+        key k{f, g, h};
+        auto cached = _cache.find(k);
+        if( cached != _cache.end() )
+        {
+            return cached->second;
+        }
+
+        uint32_t top = std::min(_nodes[f].level, std::min(_nodes[g].level, _nodes[h].level));
+        id hi = ite(_cofactor(f, top, true), _cofactor(g, top, true), _cofactor(h, top, true));
+        id lo = ite(_cofactor(f, top, false), _cofactor(g, top, false), _cofactor(h, top, false));
+        id r = _make(top, lo, hi);
+        _cache[k] = r;
+        return r;
+    }
+
+    id negate(id f){ return ite(f, zero, one); }
+    id both(id f, id g){ return ite(f, g, zero); }
+    id either(id f, id g){ return ite(f, one, g); }
+    id implies(id f, id g){ return ite(f, g, one); }
+
+    /*!
+     * \brief builds the BDD of a term over &&, ||, ! and ->, with any number of
+     * children for && and ||
+     * \throw UnknownSymbolException for any other function
+     */
+    id from_term(term<bool>& t)
+    {
+        if( _nodes.size() - _free.size() > _gc_threshold )
+        {
+            gc();
+        }
+        return _from_term(t);
+    }
+
+    /*!
+     * \brief turns a BDD back into a term, with the usual shortcuts so x comes
+     * back as x and not as ||(&&(x, true), &&(!(x), false))
+     */
+    term_ptr<bool> to_term(id f)
+    {
+        std::unordered_map<id, term_ptr<bool>> built;
+        return _to_term(f, built);
+    }
+
+    /*!
+     * \brief the canonical form of t, equivalent terms come back the same
+     */
+    term_ptr<bool> canonicalize(term<bool>& t)
+    {
+        return to_term(from_term(t));
+    }
+
+    bool equivalent(term<bool>& a, term<bool>& b)
+    {
+        id x = from_term(a);
+        ref(x);
+        bool same = x == from_term(b);
+        deref(x);
+        return same;
+    }
+
+    void ref(id f){ ++_refs[f]; }
+    void deref(id f){ if(_refs[f] > 0) --_refs[f]; }
+
+    /*!
+     * \brief frees every node not reachable from a referenced one
+     */
+    void gc()
+    {
+        std::vector<bool> live(_nodes.size(), false);
+        std::vector<id> todo;
+        for(id f = 0; f < _nodes.size(); ++f)
+        {
+            if( _refs[f] > 0 )
+            {
+                todo.push_back(f);
+            }
+        }
+        while( !todo.empty() )
+        {
+            id f = todo.back();
+            todo.pop_back();
+            if( live[f] )
+            {
+                continue;
+            }
+            live[f] = true;
+            if( _nodes[f].level != terminal )
+            {
+                todo.push_back(_nodes[f].lo);
+                todo.push_back(_nodes[f].hi);
+            }
+        }
+
+        _free.clear();
+        for(id f = 2; f < _nodes.size(); ++f)
+        {
+            if( !live[f] )
+            {
+                if( _nodes[f].level != dead )
+                {
+                    _unique.erase(key{_nodes[f].level, _nodes[f].lo, _nodes[f].hi});
+                    _nodes[f].level = dead;
+                }
+                _free.push_back(f);
+            }
+        }
+        // The cache could name dead nodes
+        _cache.clear();
+    }
+
+    size_t size() const {return _nodes.size() - _free.size();}
+
+private:
+    static constexpr uint32_t terminal = uint32_t(-1);
+    static constexpr uint32_t dead = uint32_t(-2);
+
+    struct node
+    {
+        uint32_t level;
+        id lo;
+        id hi;
+    };
+
+    struct key
+    {
+        uint32_t a, b, c;
+        bool operator==(const key& rhs) const {return a == rhs.a && b == rhs.b && c == rhs.c;}
+    };
+
+    struct key_hash
+    {
+        size_t operator()(const key& k) const
+        {
+            return (size_t(k.a) * 0x9e3779b97f4a7c15ull) ^ (size_t(k.b) * 0xc2b2ae3d27d4eb4full) ^ (size_t(k.c) << 17) ^ k.c;
+        }
+    };
+
+    uint32_t _level(const std::string& name)
+    {
+        auto found = _levels.find(name);
+        if( found != _levels.end() )
+        {
+            return found->second;
+        }
+        uint32_t level = _names.size();
+        _names.push_back(name);
+        return _levels[name] = level;
+    }
+
+    id _make(uint32_t level, id lo, id hi)
+    {
+        // Reduced, a test whose branches agree isn't a test
+        if( lo == hi )
+        {
+            return lo;
+        }
+        key k{level, lo, hi};
+        auto found = _unique.find(k);
+        if( found != _unique.end() )
+        {
+            return found->second;
+        }
+        id f;
+        if( !_free.empty() )
+        {
+            f = _free.back();
+            _free.pop_back();
+            _nodes[f] = node{level, lo, hi};
+            _refs[f] = 0;
+        }
+        else
+        {
+            f = _nodes.size();
+            _nodes.push_back(node{level, lo, hi});
+            _refs.push_back(0);
+        }
+        _unique[k] = f;
+        return f;
+    }
+
+    id _cofactor(id f, uint32_t level, bool high)
+    {
+        if( _nodes[f].level != level )
+        {
+            return f;
+        }
+        return high ? _nodes[f].hi : _nodes[f].lo;
+    }
+
+    id _from_term(term<bool>& t)
+    {
+        switch( t.kind() ){
+        case term_kind::literal:
+            return static_cast<literal<bool>&>(t).value() ? one : zero;
+        case term_kind::variable:
+            return var(static_cast<variable<bool>&>(t).var());
+        case term_kind::function:
+            break;
+        }
+
+        auto& f = static_cast<function<bool>&>(t);
+        auto& children = f.children();
+        const std::string& name = f.name();
+        if( name == "!" && children.size() == 1 )
+        {
+            return negate(_from_term(*children[0]));
+        }
+        if( name == "->" && children.size() == 2 )
+        {
+            id a = _from_term(*children[0]);
+            return implies(a, _from_term(*children[1]));
+        }
+        if( name == "&&" || name == "||" )
+        {
+            bool conj = name == "&&";
+            id r = conj ? one : zero;
+            for(auto& c: children)
+            {
+                id x = _from_term(*c);
+                r = conj ? both(r, x) : either(r, x);
+            }
+            return r;
+        }
+        throw UnknownSymbolException();
+    }
+
+    term_ptr<bool> _to_term(id f, std::unordered_map<id, term_ptr<bool>>& built)
+    {
+        if( f == zero || f == one )
+        {
+            return make_term<literal<bool>>(f == one);
+        }
+        auto done = built.find(f);
+        if( done != built.end() )
+        {
+            return done->second;
+        }
+
+        const node n = _nodes[f];
+        term_ptr<bool> x = make_term<variable<bool>>(_names[n.level]);
+        auto not_x = [&](){ return _function("!", {x}); };
+        term_ptr<bool> t;
+        if( n.hi == one && n.lo == zero )      t = x;
+        else if( n.hi == zero && n.lo == one ) t = not_x();
+        else if( n.lo == zero )                t = _function("&&", {x, _to_term(n.hi, built)});
+        else if( n.hi == zero )                t = _function("&&", {not_x(), _to_term(n.lo, built)});
+        else if( n.hi == one )                 t = _function("||", {x, _to_term(n.lo, built)});
+        else if( n.lo == one )                 t = _function("||", {not_x(), _to_term(n.hi, built)});
+        else
+        {
+            t = _function("||", {_function("&&", {x, _to_term(n.hi, built)}),
+                                 _function("&&", {not_x(), _to_term(n.lo, built)})});
+        }
+        return built[f] = t;
+    }
+
+    static term_ptr<bool> _function(const char* name, std::vector< term_ptr<bool> > children)
+    {
+        return make_term<function<bool>>(name, children.size(), std::move(children));
+    }
+
+    size_t _gc_threshold;
+
+    std::vector<node> _nodes;
+    std::vector<uint32_t> _refs;
+    std::vector<id> _free;
+    std::unordered_map<key, id, key_hash> _unique;
+    std::unordered_map<key, id, key_hash> _cache;
+
+    std::unordered_map<std::string, uint32_t> _levels;
+    std::vector<std::string> _names;
+};
+
+#endif // BDD_HPP
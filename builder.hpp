@@ -0,0 +1,96 @@
+#ifndef BUILDER_HPP
+#define BUILDER_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <initializer_list>
+#include "Term.hpp"
+
+/**
+ * Building terms without the copies.
+ *
+ * make_term<function<T>>(function<T>("&&", 2, {x, y})) builds the node twice,
+ * once on the stack and once more in the allocation, and copies the children
+ * into the initializer list and then the vector. term_builder makes each node
+ * in place, in the one allocation make_term gives it, and moves the children
+ * into a vector reserved to the exact size.
+ *
+ *     term_builder<bool> bools{ {"&&", 2}, {"||", 2}, {"!", 1}, {"->", 2} };
+ *     term_ptr<bool> t = bools.fun("&&", bools.var("x"), bools.lit(false));
+ *
+ * Function symbols declared with their arity are checked every time they're
+ * built, and building one with the wrong number of children throws
+ * InvalidArityException. Symbols that weren't declared can take any number.
+ */
+template<typename T>
+class term_builder
+{
+public:
+    term_builder(){}
+    term_builder(std::initializer_list< std::pair<const std::string, uint32_t> > signature):
+        _arity{signature}
+    {}
+
+    /*!
+     * \brief declares a function symbol and its arity
+     */
+    void declare(const std::string& name, uint32_t arity)
+    {
+        _arity[name] = arity;
+    }
+
+    variable_ptr<T> var(std::string name) const
+    {
+        return make_term<variable<T>>(std::move(name));
+    }
+
+    literal_ptr<T> lit(T value) const
+    {
+        return make_term<literal<T>>(std::move(value));
+    }
+
+    /*!
+     * \brief a function with the given children, pass them as rvalues to move them in
+     * \throw InvalidArityException if name was declared with another arity
+     */
+    template<typename... Children>
+    function_ptr<T> fun(std::string name, Children&&... children) const
+    {
+        _check(name, sizeof...(Children));
+        std::vector< term_ptr<T> > subterms;
+        subterms.reserve(sizeof...(Children));
+        (subterms.push_back(term_ptr<T>(std::forward<Children>(children))), ...);
+        return make_term<function<T>>(std::move(name), sizeof...(Children), std::move(subterms));
+    }
+
+    /*!
+     * \brief a function over children already gathered into a vector, which is taken over
+     * \throw InvalidArityException if name was declared with another arity
+     */
+    function_ptr<T> fun(std::string name, std::vector< term_ptr<T> >&& subterms) const
+    {
+        _check(name, subterms.size());
+        uint32_t arity = subterms.size();
+        return make_term<function<T>>(std::move(name), arity, std::move(subterms));
+    }
+
+private:
+    void _check(const std::string& name, size_t n) const
+    {
+        if( _arity.empty() )
+        {
+            return;
+        }
+        auto declared = _arity.find(name);
+        if( declared != _arity.end() && declared->second != n )
+        {
+            throw InvalidArityException();
+        }
+    }
+
+    std::unordered_map<std::string, uint32_t> _arity;
+};
+
+#endif // BUILDER_HPP
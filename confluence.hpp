@@ -0,0 +1,230 @@
+#ifndef CONFLUENCE_HPP
+#define CONFLUENCE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "Term.hpp"
+#include "normalize.hpp"
+#include "unifier.hpp"
+#include "scan.hpp"
+
+/**
+ * Critical pairs and local confluence of a rule set.
+ *
+ * reduce() and normalize() try the rules in order, so when two rules overlap
+ * the answer can depend on which one fires first. A critical pair is such an
+ * overlap: the left hand side of one rule (the inner one) unifies with a
+ * non-variable subterm of another's (the outer one), and the most general
+ * unifier gives a peak term that both rules reduce, to left by the outer rule
+ * and to right by the inner one. If every critical pair normalizes to the same
+ * term from both sides the rules are locally confluent, and if they also
+ * terminate, the order never matters.
+ *
+ * Only inner rules whose head symbol is the symbol at the position are tried,
+ * looked up through rule_heads from scan.hpp, so most of the rules x positions
+ * x rules overlaps are never unified. The outer rules are shared out between
+ * threads, and each thread works on its own deep copy of the rules, since
+ * normalizing marks nodes and a term_handle count isn't atomic.
+ *
+ * Joinability is checked with normalize, so the rules must terminate.
+ */
+
+template<typename T>
+struct critical_pair
+{
+    size_t outer;       // the rule applied at the root of the peak
+    size_t inner;       // the rule applied at the position
+    path at;            // the position in the outer rule's left hand side
+    term_ptr<T> peak;
+    term_ptr<T> left;   // peak reduced by the outer rule
+    term_ptr<T> right;  // peak reduced by the inner rule
+    bool joinable;
+};
+
+template<typename T>
+class confluence
+{
+public:
+    /*!
+     * \param std::vector<rule<T>>& rules is the rule set to check, it is only read
+     * \param unsigned threads is how many threads to use, 0 for one per core
+     */
+    confluence(const std::vector<rule<T>>& rules, unsigned threads = 0):
+        _rules{rules},
+        _threads{threads ? threads : std::max(1u, std::thread::hardware_concurrency())}
+    {}
+
+    /*!
+     * \brief every critical pair, ordered by outer rule, position, then inner rule
+     *
+     * \throw whatever the first thread to fail threw, once every thread has stopped
+     */
+    std::vector<critical_pair<T>> critical_pairs()
+    {
+        std::atomic<size_t> next{0};
+        std::mutex lock;
+        std::vector<critical_pair<T>> ret;
+        std::exception_ptr error;
+
+        auto work = [&](){
+            try
+            {
+                std::vector<rule<T>> rules = _copy(_rules);
+                rule_heads<T> heads(rules);
+                std::vector<critical_pair<T>> found;
+                for(size_t r = next++; r < rules.size(); r = next++)
+                {
+                    _overlaps(rules, heads, r, found);
+                }
+                std::lock_guard<std::mutex> hold(lock);
+                for(auto& cp: found)
+                {
+                    ret.push_back(std::move(cp));
+                }
+            }
+            catch(...)
+            {
+                // Stop the others too, and let the caller see it
+                next = _rules.size();
+                std::lock_guard<std::mutex> hold(lock);
+                if( !error )
+                {
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for(unsigned i = 1; i < std::min<size_t>(_threads, _rules.size()); ++i)
+        {
+            pool.emplace_back(work);
+        }
+        work();
+        for(auto& t: pool)
+        {
+            t.join();
+        }
+        if( error )
+        {
+            std::rethrow_exception(error);
+        }
+
+        // The threads finish in any order, put the pairs back in a fixed one
+        std::sort(ret.begin(), ret.end(), [](const critical_pair<T>& a, const critical_pair<T>& b){
+            if( a.outer != b.outer ) return a.outer < b.outer;
+            if( a.at != b.at ) return a.at < b.at;
+            return a.inner < b.inner;
+        });
+        return ret;
+    }
+
+    /*!
+     * \brief if every critical pair is joinable
+     */
+    bool locally_confluent()
+    {
+        for(auto& cp: critical_pairs())
+        {
+            if( !cp.joinable )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    /*!
+     * \brief finds the critical pairs with rule r as the outer rule
+     */
+    void _overlaps(const std::vector<rule<T>>& rules, const rule_heads<T>& heads, size_t r,
+                   std::vector<critical_pair<T>>& found)
+    {
+        term_ptr<T> lhs = rename_apart(rules[r].first, "1");
+        term_ptr<T> rhs = rename_apart(rules[r].second, "1");
+
+        // Every non-variable position in the outer left hand side, preorder
+        std::vector< std::pair<path, term_ptr<T>> > todo{ {path(), lhs} };
+        while( !todo.empty() )
+        {
+            path at = std::move(todo.back().first);
+            term_ptr<T> sub = todo.back().second;
+            todo.pop_back();
+            if( sub->isVariable() )
+            {
+                continue;
+            }
+            auto& children = sub->children();
+            for(size_t i = children.size(); i > 0; --i)
+            {
+                path deeper = at;
+                deeper.push_back(i);
+                todo.emplace_back(std::move(deeper), children[i-1]);
+            }
+
+            for(auto inner: heads.rules_for(sub->symbol()))
+            {
+                // A rule always overlaps itself at the root, and two rules
+                // overlapping at the root is the one pair, not two
+                if( at.empty() && inner <= r )
+                {
+                    continue;
+                }
+                term_ptr<T> l2 = rename_apart(rules[inner].first, "2");
+                unifier<T> u;
+                if( !u.unify(sub, l2) )
+                {
+                    continue;
+                }
+                term_ptr<T> r2 = rename_apart(rules[inner].second, "2");
+                // A plain swap, r2's variables stay variables for the unifier to resolve
+                term_ptr<T> replaced = replace_at(lhs, at, 0, r2);
+
+                critical_pair<T> cp{r, inner, at, u.resolve(lhs), u.resolve(rhs), u.resolve(replaced), false};
+                cp.joinable = *normalize(cp.left, rules) == *normalize(cp.right, rules);
+                found.push_back(std::move(cp));
+            }
+        }
+    }
+
+    static std::vector<rule<T>> _copy(const std::vector<rule<T>>& rules)
+    {
+        std::vector<rule<T>> ret;
+        ret.reserve(rules.size());
+        for(auto& r: rules)
+        {
+            ret.emplace_back(_copy(*r.first), _copy(*r.second));
+        }
+        return ret;
+    }
+
+    /*!
+     * \brief a copy that shares no nodes, and takes no handles, on the original
+     */
+    static term_ptr<T> _copy(term<T>& t)
+    {
+        if( !t.isFunction() )
+        {
+            return t.clone();
+        }
+        auto& f = static_cast<function<T>&>(t);
+        std::vector< term_ptr<T> > subterms;
+        subterms.reserve(f.children().size());
+        for(auto& c: f.children())
+        {
+            subterms.push_back(_copy(*c));
+        }
+        return make_term<function<T>>(f.name(), f.arity(), std::move(subterms));
+    }
+
+    const std::vector<rule<T>>& _rules;
+    unsigned _threads;
+};
+
+#endif // CONFLUENCE_HPP
@@ -0,0 +1,512 @@
+#ifndef EGRAPH_HPP
+#define EGRAPH_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include "Term.hpp"
+
+/**
+ * An e-graph for equality saturation.
+ *
+ * reduce() and normalize() rewrite greedily, the first rule that matches wins
+ * and the old term is gone, so the answer depends on the rule order and on
+ * rule sets that aren't confluent it's often not the best one. An e-graph keeps
+ * every term it has seen, grouped into classes of terms known to be equal.
+ * Rules only ever add equalities, so commutativity and friends are fine, and
+ * once no rule adds anything new (or a limit is hit) the cheapest term in the
+ * root's class is extracted under a cost model.
+ *
+ * e-nodes are hash-consed, classes live in a union-find, and after each batch
+ * of merges rebuild() restores congruence (if a = b then f(a) = f(b)) the way
+ * egg does, by re-canonicalizing the parents of every class that changed.
+ * Each iteration first finds every match of every rule, using an index from
+ * head symbol to classes so a rule is only tried where its head occurs, and
+ * only then applies them, so the result doesn't depend on the rule order.
+ */
+
+/*!
+ * \brief one node of the e-graph, a term whose children are e-classes
+ */
+template<typename T>
+struct enode
+{
+    term_kind kind;
+    std::string name;            // function or variable name
+    T value{};                   // literal value
+    std::vector<size_t> children;
+
+    bool operator==(const enode& rhs) const
+    {
+        return kind == rhs.kind && name == rhs.name && value == rhs.value && children == rhs.children;
+    }
+};
+
+template<typename T>
+struct enode_hash
+{
+    size_t operator()(const enode<T>& n) const
+    {
+        size_t h = std::hash<std::string>()(n.name) ^ (size_t(n.kind) << 1) ^ (std::hash<T>()(n.value) << 3);
+        for(auto c: n.children)
+        {
+            h ^= c + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        }
+        return h;
+    }
+};
+
+template<typename T>
+class egraph
+{
+public:
+    typedef size_t id;
+    typedef std::map<std::string, id> binding;
+    typedef std::function<double(const enode<T>&)> cost_function;
+
+    /*!
+     * \param size_t node_limit, saturation stops once the graph has this many e-nodes
+     * \param size_t iteration_limit, and after this many rounds of rule application
+     */
+    egraph(size_t node_limit = 10000, size_t iteration_limit = 30):
+        _node_limit{node_limit},
+        _iteration_limit{iteration_limit}
+    {}
+
+    /*!
+     * \brief adds a term, and every subterm, returning the class it ends up in
+     */
+    id add(const term_ptr<T>& t)
+    {
+        enode<T> n{t->kind(), "", T{}, {}};
+        switch( t->kind() ){
+        case term_kind::variable: n.name = static_cast<variable<T>&>(*t).var(); break;
+        case term_kind::literal:  n.value = static_cast<literal<T>&>(*t).value(); break;
+        case term_kind::function:
+            n.name = static_cast<function<T>&>(*t).name();
+            for(auto& c: t->children())
+            {
+                n.children.push_back(add(c));
+            }
+            break;
+        }
+        return _add(n);
+    }
+
+    id find(id a)
+    {
+        while( _parent[a] != a )
+        {
+            _parent[a] = _parent[_parent[a]];
+            a = _parent[a];
+        }
+        return a;
+    }
+
+    /*!
+     * \brief records that two classes are equal, call rebuild() before matching again
+     *
+     * \return bool if they weren't already
+     */
+    bool merge(id a, id b)
+    {
+        a = find(a);
+        b = find(b);
+        if( a == b )
+        {
+            return false;
+        }
+        if( _classes[a].nodes.size() < _classes[b].nodes.size() )
+        {
+            std::swap(a, b);
+        }
+        _parent[b] = a;
+        auto& into = _classes[a];
+        auto& from = _classes[b];
+        into.nodes.insert(into.nodes.end(), from.nodes.begin(), from.nodes.end());
+        into.parents.insert(into.parents.end(), from.parents.begin(), from.parents.end());
+        from.nodes.clear();
+        from.parents.clear();
+        _pending.push_back(a);
+        return true;
+    }
+
+    /*!
+     * \brief restores the hash-cons and congruence after merges
+     */
+    void rebuild()
+    {
+        while( !_pending.empty() )
+        {
+            std::vector<id> todo;
+            todo.swap(_pending);
+            for(auto& c: todo)
+            {
+                c = find(c);
+            }
+            std::sort(todo.begin(), todo.end());
+            todo.erase(std::unique(todo.begin(), todo.end()), todo.end());
+            for(auto c: todo)
+            {
+                _repair(find(c));
+            }
+        }
+
+        // Tidy each class's own nodes so matching sees every node once
+        for(id c = 0; c < _classes.size(); ++c)
+        {
+            if( find(c) != c )
+            {
+                continue;
+            }
+            auto& nodes = _classes[c].nodes;
+            for(auto& n: nodes)
+            {
+                _canonicalize(n);
+            }
+            std::unordered_map<enode<T>, bool, enode_hash<T>> seen;
+            std::vector< enode<T> > unique;
+            for(auto& n: nodes)
+            {
+                if( seen.emplace(n, true).second )
+                {
+                    unique.push_back(n);
+                }
+            }
+            nodes.swap(unique);
+        }
+    }
+
+    /*!
+     * \brief applies the rules in batches until nothing changes or a limit is hit
+     *
+     * \return size_t the number of iterations run
+     */
+    size_t saturate(const std::vector<rule<T>>& rules)
+    {
+        rebuild();
+        size_t iteration = 0;
+        for(; iteration < _iteration_limit && _memo.size() < _node_limit; ++iteration)
+        {
+            // Head symbol to the classes holding a node with it
+            std::unordered_map<std::string, std::vector<id>> index;
+            std::vector<id> literals, all;
+            for(id c = 0; c < _classes.size(); ++c)
+            {
+                if( find(c) != c )
+                {
+                    continue;
+                }
+                all.push_back(c);
+                bool literal_seen = false;
+                std::vector<std::string> names;
+                for(auto& n: _classes[c].nodes)
+                {
+                    if( n.kind == term_kind::function && std::find(names.begin(), names.end(), n.name) == names.end() )
+                    {
+                        names.push_back(n.name);
+                        index[n.name].push_back(c);
+                    }
+                    literal_seen = literal_seen || n.kind == term_kind::literal;
+                }
+                if( literal_seen )
+                {
+                    literals.push_back(c);
+                }
+            }
+
+            // Find everything first
+            std::vector< std::pair<size_t, std::pair<id, binding>> > matches;
+            for(size_t r = 0; r < rules.size(); ++r)
+            {
+                term<T>& lhs = *rules[r].first;
+                const std::vector<id>* where = &all;
+                if( lhs.isFunction() )
+                {
+                    auto found = index.find(static_cast<function<T>&>(lhs).name());
+                    if( found == index.end() )
+                    {
+                        continue;
+                    }
+                    where = &found->second;
+                }
+                else if( lhs.isLiteral() )
+                {
+                    where = &literals;
+                }
+                for(auto c: *where)
+                {
+                    for(auto& b: ematch(lhs, c))
+                    {
+                        matches.emplace_back(r, std::make_pair(c, b));
+                    }
+                }
+            }
+
+            // Then apply it all
+            size_t before = _memo.size();
+            bool changed = false;
+            for(auto& m: matches)
+            {
+                if( _memo.size() >= _node_limit )
+                {
+                    break;
+                }
+                id rhs = _instantiate(*rules[m.first].second, m.second.second);
+                changed = merge(m.second.first, rhs) || changed;
+            }
+            rebuild();
+            if( !changed && _memo.size() == before )
+            {
+                ++iteration;
+                break;
+            }
+        }
+        return iteration;
+    }
+
+    /*!
+     * \brief every way pattern matches some node in class c, as bindings of its variables to classes
+     */
+    std::vector<binding> ematch(term<T>& pattern, id c)
+    {
+        return _ematch(pattern, find(c), binding{});
+    }
+
+    /*!
+     * \brief the cheapest term in class c, by default every node costs 1
+     *
+     * \param cost_function cost gives the cost of a node on its own, it must be positive
+     */
+    term_ptr<T> extract(id c, cost_function cost = [](const enode<T>&){ return 1.0; })
+    {
+        rebuild();
+        const double inf = std::numeric_limits<double>::infinity();
+        std::vector<double> best(_classes.size(), inf);
+        std::vector<const enode<T>*> choice(_classes.size(), nullptr);
+
+        // Relax until nothing gets cheaper, like Bellman-Ford
+        bool changed = true;
+        while( changed )
+        {
+            changed = false;
+            for(id k = 0; k < _classes.size(); ++k)
+            {
+                if( find(k) != k )
+                {
+                    continue;
+                }
+                for(auto& n: _classes[k].nodes)
+                {
+                    double total = cost(n);
+                    for(auto child: n.children)
+                    {
+                        total += best[find(child)];
+                    }
+                    if( total < best[k] )
+                    {
+                        best[k] = total;
+                        choice[k] = &n;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        std::unordered_map<id, term_ptr<T>> built;
+        return _build(find(c), choice, built);
+    }
+
+    size_t nodes() const {return _memo.size();}
+    size_t classes()
+    {
+        size_t count = 0;
+        for(id c = 0; c < _classes.size(); ++c)
+        {
+            count += find(c) == c;
+        }
+        return count;
+    }
+
+private:
+    struct eclass
+    {
+        std::vector< enode<T> > nodes;
+        std::vector< std::pair<enode<T>, id> > parents;
+    };
+
+    void _canonicalize(enode<T>& n)
+    {
+        for(auto& c: n.children)
+        {
+            c = find(c);
+        }
+    }
+
+    id _add(enode<T> n)
+    {
+        _canonicalize(n);
+        auto found = _memo.find(n);
+        if( found != _memo.end() )
+        {
+            return find(found->second);
+        }
+        id c = _classes.size();
+        _parent.push_back(c);
+        _classes.push_back(eclass{{n}, {}});
+        for(auto child: n.children)
+        {
+            _classes[find(child)].parents.emplace_back(n, c);
+        }
+        _memo[n] = c;
+        return c;
+    }
+
+    void _repair(id c)
+    {
+        // Parents hash differently now their child's class has changed
+        auto parents = _classes[c].parents;
+        for(auto& p: parents)
+        {
+            _memo.erase(p.first);
+            _canonicalize(p.first);
+            _memo[p.first] = find(p.second);
+        }
+
+        // Two parents that now look the same are congruent, so equal
+        std::unordered_map<enode<T>, id, enode_hash<T>> unique;
+        for(auto& p: parents)
+        {
+            auto found = unique.find(p.first);
+            if( found != unique.end() )
+            {
+                merge(p.second, found->second);
+            }
+            unique[p.first] = find(p.second);
+        }
+
+        auto& keep = _classes[find(c)].parents;
+        keep.clear();
+        for(auto& p: unique)
+        {
+            keep.emplace_back(p.first, p.second);
+        }
+    }
+
+    std::vector<binding> _ematch(term<T>& p, id c, const binding& sigma)
+    {
+        std::vector<binding> ret;
+        switch( p.kind() ){
+        case term_kind::variable:
+        {
+            std::string name = static_cast<variable<T>&>(p).var();
+            auto bound = sigma.find(name);
+            if( bound == sigma.end() )
+            {
+                binding b = sigma;
+                b[name] = c;
+                ret.push_back(b);
+            }
+            else if( find(bound->second) == c )
+            {
+                ret.push_back(sigma);
+            }
+            return ret;
+        }
+        case term_kind::literal:
+            for(auto& n: _classes[c].nodes)
+            {
+                if( n.kind == term_kind::literal && n.value == static_cast<literal<T>&>(p).value() )
+                {
+                    ret.push_back(sigma);
+                    break;
+                }
+            }
+            return ret;
+        case term_kind::function:
+            break;
+        }
+
+        auto& f = static_cast<function<T>&>(p);
+        // Copy, matching the children doesn't change the graph but be safe with references
+        auto nodes = _classes[c].nodes;
+        for(auto& n: nodes)
+        {
+            if( n.kind != term_kind::function || n.name != f.name() || n.children.size() != f.children().size() )
+            {
+                continue;
+            }
+            std::vector<binding> partial{sigma};
+            for(size_t i = 0; i < n.children.size() && !partial.empty(); ++i)
+            {
+                std::vector<binding> next;
+                for(auto& b: partial)
+                {
+                    auto more = _ematch(*f.children()[i], find(n.children[i]), b);
+                    next.insert(next.end(), more.begin(), more.end());
+                }
+                partial.swap(next);
+            }
+            ret.insert(ret.end(), partial.begin(), partial.end());
+        }
+        return ret;
+    }
+
+    id _instantiate(term<T>& t, const binding& sigma)
+    {
+        enode<T> n{t.kind(), "", T{}, {}};
+        switch( t.kind() ){
+        case term_kind::variable: return find(sigma.at(static_cast<variable<T>&>(t).var()));
+        case term_kind::literal:  n.value = static_cast<literal<T>&>(t).value(); break;
+        case term_kind::function:
+            n.name = static_cast<function<T>&>(t).name();
+            for(auto& c: t.children())
+            {
+                n.children.push_back(_instantiate(*c, sigma));
+            }
+            break;
+        }
+        return _add(n);
+    }
+
+    term_ptr<T> _build(id c, const std::vector<const enode<T>*>& choice, std::unordered_map<id, term_ptr<T>>& built)
+    {
+        auto done = built.find(c);
+        if( done != built.end() )
+        {
+            return done->second;
+        }
+        const enode<T>& n = *choice[c];
+        term_ptr<T> t;
+        switch( n.kind ){
+        case term_kind::variable: t = make_term<variable<T>>(n.name); break;
+        case term_kind::literal:  t = make_term<literal<T>>(n.value); break;
+        case term_kind::function:
+        {
+            std::vector< term_ptr<T> > subterms;
+            for(auto child: n.children)
+            {
+                subterms.push_back(_build(find(child), choice, built));
+            }
+            t = make_term<function<T>>(n.name, n.children.size(), std::move(subterms));
+            break;
+        }
+        }
+        return built[c] = t;
+    }
+
+    size_t _node_limit;
+    size_t _iteration_limit;
+
+    std::vector<id> _parent;
+    std::vector<eclass> _classes;
+    std::unordered_map<enode<T>, id, enode_hash<T>> _memo;
+    std::vector<id> _pending;
+};
+
+#endif // EGRAPH_HPP
@@ -0,0 +1,190 @@
+#ifndef EVALUATE_HPP
+#define EVALUATE_HPP
+
+#include <string>
+#include <new>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <type_traits>
+#include "Term.hpp"
+
+/**
+ * Native evaluation of function symbols over literals (constant folding).
+ *
+ * An evaluator takes the values of a function's children and gives back the
+ * value of the function. When every child of a node is a literal, the node
+ * collapses straight to a literal without going through pattern matching.
+ * Each evaluator is registered with the number of children it takes, and a
+ * node with any other number is left alone for the rules.
+ *
+ * The built in evaluators for bool and integral types are written with bitwise
+ * and arithmetic operators only, no short circuiting, so they don't branch on
+ * the values. The arithmetic is done unsigned, where overflow wraps, and cast
+ * back. Normalization goes innermost first, so a whole ground subterm is
+ * folded bottom up in the one pass.
+ */
+
+template<typename T>
+using evaluator = std::function<T(const T* args, size_t n)>;
+
+// What an evaluator that captures nothing is kept as, a call through it doesn't go through std::function
+template<typename T>
+using native_evaluator = T (*)(const T* args, size_t n);
+
+template<typename T>
+class evaluators
+{
+public:
+    static const size_t variadic = size_t(-1);
+
+    /*!
+     * \brief registers e for name, for nodes with least to most children
+     * \param E e is anything callable as T(const T*, size_t), a plain function or
+     * a lambda capturing nothing is called directly, anything else through an evaluator<T>
+     */
+    template<typename E>
+    void add(std::string name, E e, size_t least = 0, size_t most = variadic)
+    {
+        if constexpr( std::is_convertible<E, native_evaluator<T>>::value )
+        {
+            _table[name] = entry{native_evaluator<T>(e), evaluator<T>(), least, most};
+        }
+        else
+        {
+            _table[name] = entry{nullptr, evaluator<T>(std::move(e)), least, most};
+        }
+    }
+
+    bool empty() const {return _table.empty();}
+
+    /*!
+     * \brief folds t if it is a function we can evaluate and all its children are literals
+     * \param term_ptr<T> t is the term to fold
+     * \param term_ptr<T>& out gets the literal
+     *
+     * \return bool if t was folded
+     */
+    bool fold(const term_ptr<T>& t, term_ptr<T>& out) const
+    {
+        if( _table.empty() || !t->isFunction() )
+        {
+            return false;
+        }
+        auto& f = static_cast<function<T>&>(*t);
+        auto e = _table.find(f.name());
+        const size_t n = f.children().size();
+        if( e == _table.end() || n < e->second.least || n > e->second.most )
+        {
+            return false;
+        }
+
+        for(auto& c: f.children())
+        {
+            if( !c->isLiteral() )
+            {
+                return false;
+            }
+        }
+
+        arguments args(n);
+        for(auto& c: f.children())
+        {
+            args.push(static_cast<literal<T>&>(*c).value());
+        }
+        const entry& call = e->second;
+        out = make_term<literal<T>>(call.native ? call.native(args.data(), n) : call.eval(args.data(), n));
+        return true;
+    }
+
+private:
+    struct entry
+    {
+        native_evaluator<T> native;
+        evaluator<T> eval;
+        size_t least;
+        size_t most;
+    };
+
+    /*!
+     * \brief the values of the children, only the n of them are ever constructed,
+     * on the stack for most functions
+     */
+    class arguments
+    {
+    public:
+        arguments(size_t n)
+        {
+            if( n > small )
+            {
+                _large = std::allocator<T>().allocate(n);
+                _n = n;
+            }
+        }
+        ~arguments()
+        {
+            T* p = data();
+            for(size_t i = 0; i < _built; ++i)
+            {
+                p[i].~T();
+            }
+            if( _large )
+            {
+                std::allocator<T>().deallocate(_large, _n);
+            }
+        }
+        arguments(const arguments&) = delete;
+        arguments& operator=(const arguments&) = delete;
+
+        void push(const T& value)
+        {
+            ::new(static_cast<void*>(_slot(_built))) T(value);
+            ++_built;
+        }
+        T* data() {return _large ? _large : std::launder(reinterpret_cast<T*>(_small));}
+
+    private:
+        static const size_t small = 8;
+
+        T* _slot(size_t i) {return (_large ? _large : reinterpret_cast<T*>(_small)) + i;}
+
+        alignas(T) unsigned char _small[small * sizeof(T)];
+        T* _large{nullptr};
+        size_t _n{0};
+        size_t _built{0};
+    };
+
+    std::unordered_map<std::string, entry> _table;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Built in evaluators
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief &&, ||, ! and -> over bool, with the same names TermsTest uses
+ */
+inline void boolean_evaluators(evaluators<bool>& e)
+{
+    e.add("&&", [](const bool* a, size_t n){ bool r = true;  for(size_t i = 0; i < n; ++i) r &= a[i]; return r; });
+    e.add("||", [](const bool* a, size_t n){ bool r = false; for(size_t i = 0; i < n; ++i) r |= a[i]; return r; });
+    e.add("!",  [](const bool* a, size_t  ){ return !a[0]; }, 1, 1);
+    e.add("->", [](const bool* a, size_t  ){ return bool(!a[0] | a[1]); }, 2, 2);
+}
+
+/*!
+ * \brief +, - and * over integral types, wrapping on overflow
+ */
+template<typename T>
+void arithmetic_evaluators(evaluators<T>& e)
+{
+    static_assert(std::is_integral<T>::value && !std::is_same<T, bool>::value,
+                  "arithmetic_evaluators needs an integral type other than bool");
+    // Unsigned, and at least as wide as unsigned so nothing is promoted back to int
+    typedef std::common_type_t<std::make_unsigned_t<T>, unsigned> U;
+    e.add("+", [](const T* a, size_t n){ U r = 0; for(size_t i = 0; i < n; ++i) r += U(a[i]); return T(r); });
+    e.add("*", [](const T* a, size_t n){ U r = 1; for(size_t i = 0; i < n; ++i) r *= U(a[i]); return T(r); });
+    e.add("-", [](const T* a, size_t n){ return n == 1 ? T(U(0) - U(a[0])) : T(U(a[0]) - U(a[1])); }, 1, 2);
+}
+
+#endif // EVALUATE_HPP
@@ -0,0 +1,173 @@
+#ifndef HANDLE_HPP
+#define HANDLE_HPP
+
+#include <memory>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <type_traits>
+
+/**
+ * The handle type every term is held through.
+ *
+ * By default a term_ptr is a std::shared_ptr, and every copy of it pays for an
+ * atomic increment and decrement. Define TERM_INTRUSIVE_REFCOUNT (see Terms.pro)
+ * and it becomes a term_handle instead, which keeps a plain counter inside the
+ * term itself. That is only safe while a term is used by the one thread, so a
+ * term that has to be shared between threads is frozen first: freezing marks
+ * every node under it as published, and published nodes count atomically, so
+ * they are freed like any other once the last handle on any thread lets go.
+ *
+ * Either way, make nodes with make_term<U>(...) rather than std::make_shared.
+ */
+
+template<typename T>
+class term;
+template<typename T>
+class function;
+template<typename T>
+class literal;
+template<typename T>
+class variable;
+
+#ifdef TERM_INTRUSIVE_REFCOUNT
+
+/*!
+ * \brief a pointer to a term using the count kept in the term, not atomic
+ */
+template<typename U>
+class term_handle
+{
+public:
+    term_handle(): _p{nullptr} {}
+    term_handle(std::nullptr_t): _p{nullptr} {}
+    explicit term_handle(U* p): _p{p} { _retain(); }
+    term_handle(const term_handle& rhs): _p{rhs._p} { _retain(); }
+    term_handle(term_handle&& rhs) noexcept: _p{rhs._p} { rhs._p = nullptr; }
+
+    // Derived to base, like shared_ptr<function<T>> to shared_ptr<term<T>>
+    template<typename V, typename = typename std::enable_if<std::is_convertible<V*, U*>::value>::type>
+    term_handle(const term_handle<V>& rhs): _p{rhs.get()} { _retain(); }
+    template<typename V, typename = typename std::enable_if<std::is_convertible<V*, U*>::value>::type>
+    term_handle(term_handle<V>&& rhs) noexcept: _p{rhs._p} { rhs._p = nullptr; }
+
+    ~term_handle(){ _release(); }
+
+    term_handle& operator=(term_handle rhs)
+    {
+        std::swap(_p, rhs._p);
+        return *this;
+    }
+
+    U* get() const {return _p;}
+    U& operator*() const {return *_p;}
+    U* operator->() const {return _p;}
+    explicit operator bool() const {return _p != nullptr;}
+    void reset(){ term_handle().swap(*this); }
+    void swap(term_handle& rhs){ std::swap(_p, rhs._p); }
+    long use_count() const {return _p ? _p->refs() : 0;}
+
+private:
+    template<typename V>
+    friend class term_handle;
+
+    void _retain(){ if(_p) _p->retain(); }
+    void _release(){ if(_p) _p->release(); }
+
+    U* _p;
+};
+
+template<typename U, typename V>
+bool operator==(const term_handle<U>& a, const term_handle<V>& b){ return a.get() == b.get(); }
+template<typename U, typename V>
+bool operator!=(const term_handle<U>& a, const term_handle<V>& b){ return a.get() != b.get(); }
+template<typename U>
+bool operator==(const term_handle<U>& a, std::nullptr_t){ return !a; }
+template<typename U>
+bool operator!=(const term_handle<U>& a, std::nullptr_t){ return bool(a); }
+
+template<typename T>
+using term_ptr = term_handle<term<T>>;
+template<typename T>
+using variable_ptr = term_handle<variable<T>>;
+template<typename T>
+using literal_ptr = term_handle<literal<T>>;
+template<typename T>
+using function_ptr = term_handle<function<T>>;
+
+template<typename U, typename... Args>
+term_handle<U> make_term(Args&&... args)
+{
+    return term_handle<U>(new U(std::forward<Args>(args)...));
+}
+
+#else
+
+template<typename T>
+using term_ptr = std::shared_ptr<term<T>>;
+template<typename T>
+using variable_ptr = std::shared_ptr<variable<T>>;
+template<typename T>
+using literal_ptr = std::shared_ptr<literal<T>>;
+template<typename T>
+using function_ptr = std::shared_ptr<function<T>>;
+
+template<typename U, typename... Args>
+std::shared_ptr<U> make_term(Args&&... args)
+{
+    return std::make_shared<U>(std::forward<Args>(args)...);
+}
+
+#endif // TERM_INTRUSIVE_REFCOUNT
+
+/*!
+ * \brief a term published for use by more than one thread
+ *
+ * With intrusive counts every node under the term switches to an atomic count,
+ * and stays that way, so handles on it can be copied and dropped from any
+ * thread and the nodes outlive this object for as long as anyone holds one.
+ * With shared_ptr the counts are already atomic and this just holds on to the term.
+ *
+ * Publish before the term is handed to another thread, not after, and new
+ * nodes built over it are only one thread's again until they're frozen too.
+ * Freezing only changes the counting. Normalization still writes its marks into
+ * the nodes, so normalize a term before you freeze it, not after.
+ */
+template<typename T>
+class frozen
+{
+public:
+    frozen(term_ptr<T> t):
+        _root{t}
+    {
+#ifdef TERM_INTRUSIVE_REFCOUNT
+        _freeze(_root.get());
+#endif
+    }
+    frozen(const frozen&) = delete;
+    frozen& operator=(const frozen&) = delete;
+
+    const term_ptr<T>& get() const {return _root;}
+    term<T>& operator*() const {return *_root;}
+    term<T>* operator->() const {return _root.get();}
+
+private:
+#ifdef TERM_INTRUSIVE_REFCOUNT
+    void _freeze(term<T>* t)
+    {
+        // Already published, and so is everything under it
+        if( t->published() )
+        {
+            return;
+        }
+        t->publish();
+        for(auto& c: t->children())
+        {
+            _freeze(c.get());
+        }
+    }
+#endif
+    term_ptr<T> _root;
+};
+
+#endif // HANDLE_HPP
@@ -0,0 +1,292 @@
+#ifndef NORMALIZE_HPP
+#define NORMALIZE_HPP
+
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include "Term.hpp"
+#include "rules.hpp"
+#include "scan.hpp"
+
+/**
+ * Normalization to a fixed point, innermost first.
+ *
+ * Unlike reduce(), which makes one pass per rule, normalize keeps going until
+ * no rule applies anywhere. Every node it finishes with is marked normalized,
+ * so after a small edit (term::rewrite, or a change through children() followed
+ * by term::invalidate) renormalize only walks the nodes that were marked dirty,
+ * that is the spine down to the edit, and whatever new redexes show up around it.
+ *
+ * The normalized mark means "normal under the rules it was normalized with",
+ * if you change the rule set use normalize, which starts from scratch.
+ *
+ * Nothing is rewritten in place, a node whose children changed is rebuilt
+ * and untouched subterms are shared with the original term.
+ *
+ * With a std::vector<rule<T>>, or a rule_set<T> without natives, the part of the
+ * term still to be walked is scanned first for the rules' head symbols, see
+ * scan.hpp, and the rules are only tried at those nodes and at nodes the rules
+ * build on the way.
+ *
+ * Rules can be a std::vector<rule<T>> or a rule_set<T>.
+ */
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// normalizer
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief never pauses a normalizer, what renormalize runs with
+ */
+struct no_pause
+{
+    static constexpr bool wants_rule = false;
+    bool fired(size_t, const path&){ return false; }
+    bool visited(){ return false; }
+};
+
+/*!
+ * \brief the walk renormalize does, innermost first, with the recursion kept on
+ * an explicit stack so it can stop after any node and carry on later
+ *
+ * run() takes a Pause, which is told about every rule that fires, fired(rule,
+ * position) after the node there has been swapped for the rule's output, and
+ * every node finished with or gone down into, visited(). Either can say to stop
+ * there, and the next run() picks up where it left off. If Pause::wants_rule is
+ * false, the rule is only asked of apply() when the trace needs it, so the rules
+ * can be anything with a three argument apply().
+ *
+ * renormalize runs it to the end with no_pause, steps() in steps.hpp stops it
+ * at every step.
+ *
+ * Nodes of the term it started with are numbered in the order they're gone
+ * down into, which is the order flat_term lays them out in, so the scan's
+ * candidates can be looked up by that number. Nodes built since have none.
+ */
+template<typename T, typename Rules, typename Trace>
+class normalizer
+{
+public:
+    normalizer(term_ptr<T> t, const Rules& rules, Trace& trace):
+        _rules(rules), _trace(trace)
+    {
+        if constexpr( std::is_constructible<rule_heads<T>, const Rules&>::value )
+        {
+            rule_heads<T> heads(rules);
+            if( !heads.everywhere() )
+            {
+                flat_term<T> flat(t, true);
+                _candidate.assign(flat.size(), false);
+                for(auto pos: flat.candidates(heads))
+                {
+                    _candidate[pos] = true;
+                }
+            }
+        }
+        uint32_t pos = _candidate.empty() ? fresh : _next++;
+        _stack.push_back(frame{std::move(t), {}, false, pos});
+    }
+
+    /*!
+     * \brief walks on until the term is normal or pause says to stop
+     *
+     * \return bool true once the term is normal, false if pause stopped it first
+     */
+    template<typename Pause>
+    bool run(Pause& pause)
+    {
+        while( !_stack.empty() )
+        {
+            frame& top = _stack.back();
+            term_ptr<T> finished;
+            if( top.node->normalized() )
+            {
+                finished = top.node;
+            }
+            else if( top.subterms.size() < top.node->children().size() )
+            {
+                // Down to the next child
+                size_t i = top.subterms.size();
+                term_ptr<T> child = top.node->children()[i];
+                top.subterms.reserve(top.node->children().size());
+                uint32_t pos = top.pos == fresh ? fresh : _next++;
+                _at.push_back(i + 1);
+                _trace.enter(i + 1);
+                _stack.push_back(frame{std::move(child), {}, false, pos});
+                if( pause.visited() )
+                {
+                    return false;
+                }
+                continue;
+            }
+            else
+            {
+                // Children done, only build a new node if one of them changed
+                term_ptr<T> ret = top.node;
+                if( top.changed )
+                {
+                    auto& f = static_cast<function<T>&>(*top.node);
+                    ret = make_term<function<T>>(f.name(), f.arity(), std::move(top.subterms));
+                }
+
+                // Now the root, the first rule that applies wins. The bindings in
+                // sigma are our already normal children, so going round again only
+                // looks at the new nodes the right hand side built. Round again in
+                // this frame, not a new one, so a long chain of rewrites at the one
+                // node doesn't grow the stack. No rule's head is our symbol
+                // if the scan didn't pick us out.
+                term_ptr<T> out;
+                size_t fired = 0;
+                bool applied = false;
+                if( top.pos == fresh || _candidate[top.pos] )
+                {
+                    if constexpr( Trace::enabled || Pause::wants_rule )
+                    {
+                        applied = apply(_rules, ret, out, fired);
+                    }
+                    else
+                    {
+                        applied = apply(_rules, ret, out);
+                    }
+                }
+                if( applied )
+                {
+                    _trace.fired(fired);
+                    _stack.back() = frame{std::move(out), {}, false, fresh};
+                    if( pause.fired(fired, _at) )
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                ret->normalized(true);
+                finished = std::move(ret);
+            }
+
+            // Back up to the parent with what we finished
+            _stack.pop_back();
+            if( _stack.empty() )
+            {
+                _result = std::move(finished);
+                return true;
+            }
+            _at.pop_back();
+            _trace.leave();
+            frame& parent = _stack.back();
+            parent.changed = parent.changed || finished != parent.node->children()[parent.subterms.size()];
+            parent.subterms.push_back(std::move(finished));
+            if( pause.visited() )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*!
+     * \brief the node being worked on, the one a rule just fired at after fired()
+     */
+    const term_ptr<T>& current() const {return _stack.back().node;}
+
+    /*!
+     * \brief the normal form, once run() has returned true
+     */
+    const term_ptr<T>& result() const {return _result;}
+
+private:
+    // The number of a node the rules built, it wasn't scanned
+    static const uint32_t fresh = uint32_t(-1);
+
+    struct frame
+    {
+        term_ptr<T> node;
+        std::vector< term_ptr<T> > subterms;
+        bool changed;
+        uint32_t pos;
+    };
+
+    const Rules& _rules;
+    Trace& _trace;
+    std::vector<frame> _stack;
+    path _at;
+    term_ptr<T> _result;
+    std::vector<bool> _candidate;   // by number, empty when the rules can't be scanned for
+    uint32_t _next{0};
+};
+
+/*!
+ * \brief renormalizes a term, skipping every subterm already marked normalized
+ *
+ * \param term_ptr<T> t is the term to be normalized
+ * \param Rules& is a set of rules to do the reduction
+ * \param Trace& trace is told each rule that fires and where, carrying on
+ * from whatever run it is in. Tracing needs the rules to say which rule fired,
+ * so it takes a std::vector<rule<T>> or a rule_set<T>.
+ *
+ * \return term_ptr<T> the normal form of t
+ */
+template<typename T, typename Rules, typename Trace>
+term_ptr<T> renormalize( const term_ptr<T> t, const Rules& rules, Trace& trace)
+{
+    if( t->normalized() )
+    {
+        return t;
+    }
+    normalizer<T, Rules, Trace> walk(t, rules, trace);
+    no_pause never;
+    walk.run(never);
+    return walk.result();
+}
+
+template<typename T, typename Rules>
+term_ptr<T> renormalize( const term_ptr<T> t, const Rules& rules)
+{
+    no_trace none;
+    return renormalize(t, rules, none);
+}
+
+/*!
+ * \brief clears every normalized mark in the term
+ */
+template<typename T>
+void invalidate_all( const term_ptr<T> t )
+{
+    // Walked by hand, comparing term_iterators costs as much as the whole term
+    std::vector<term<T>*> todo{ t.get() };
+    while( !todo.empty() )
+    {
+        term<T>* subterm = todo.back();
+        todo.pop_back();
+        subterm->normalized(false);
+        for(auto& c: subterm->children())
+        {
+            todo.push_back(c.get());
+        }
+    }
+}
+
+/*!
+ * \brief normalizes the term from scratch, ignoring any earlier marks
+ *
+ * \param term_ptr<T> t is the term to be normalized
+ * \param Rules& is a set of rules to do the reduction
+ * \param Trace& trace starts a new run and is told each rule that fires and where
+ *
+ * \return term_ptr<T> the normal form of t
+ */
+template<typename T, typename Rules, typename Trace>
+term_ptr<T> normalize( const term_ptr<T> t, const Rules& rules, Trace& trace)
+{
+    invalidate_all(t);
+    trace.begin();
+    return renormalize(t, rules, trace);
+}
+
+template<typename T, typename Rules>
+term_ptr<T> normalize( const term_ptr<T> t, const Rules& rules)
+{
+    no_trace none;
+    return normalize(t, rules, none);
+}
+
+#endif // NORMALIZE_HPP
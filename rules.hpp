@@ -0,0 +1,237 @@
+#ifndef RULES_HPP
+#define RULES_HPP
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include "Term.hpp"
+#include "evaluate.hpp"
+
+/**
+ * Conditional rules with priorities.
+ *
+ * A guarded_rule is a plain rule plus a priority and a list of guards. The
+ * guards only look at the substitution, so they run after the left hand side
+ * has matched structurally and cost nothing on terms that don't match.
+ *
+ * rule_set keeps its rules ordered by priority, highest first, and rules with
+ * the same priority in the order they were added, so a rule_set built from a
+ * std::vector<rule<T>> behaves the same as the vector does.
+ *
+ * A rule_set can also evaluate function symbols natively (see evaluate.hpp),
+ * a node whose children are all literals is folded before any rule is tried.
+ */
+
+template<typename T>
+using guard = std::function<bool(Sub<T>&)>;
+
+template<typename T>
+struct guarded_rule
+{
+    rule<T> r;
+    int priority;
+    std::vector<guard<T>> guards;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Guards
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A guard on a variable the left hand side doesn't bind is false, not an error
+
+/*!
+ * \brief true if the variable is bound to a literal
+ */
+template<typename T>
+guard<T> is_literal(std::string var)
+{
+    return [var](Sub<T>& sigma){ return sigma.contains(var) && sigma(var).isLiteral(); };
+}
+
+/*!
+ * \brief true if the variable is bound to a literal holding value
+ */
+template<typename T>
+guard<T> literal_is(std::string var, T value)
+{
+    return [var, value](Sub<T>& sigma)
+    {
+        if( !sigma.contains(var) )
+        {
+            return false;
+        }
+        term<T>& t = sigma(var);
+        return t.isLiteral() && static_cast<literal<T>&>(t).value() == value;
+    };
+}
+
+/*!
+ * \brief true if the term contains no variables
+ */
+template<typename T>
+bool ground(term<T>& t)
+{
+    if( t.isVariable() )
+    {
+        return false;
+    }
+    return std::all_of(t.children().begin(), t.children().end(), [](const term_ptr<T>& c){ return ground(*c); });
+}
+
+/*!
+ * \brief true if the variable is bound to a term with no variables in it
+ */
+template<typename T>
+guard<T> is_ground(std::string var)
+{
+    return [var](Sub<T>& sigma){ return sigma.contains(var) && ground(sigma(var)); };
+}
+
+/*!
+ * \brief user callback on the term bound to a variable
+ */
+template<typename T>
+guard<T> satisfies(std::string var, std::function<bool(term<T>&)> f)
+{
+    return [var, f](Sub<T>& sigma){ return sigma.contains(var) && f(sigma(var)); };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// rule_set
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+class rule_set
+{
+public:
+    rule_set(){}
+    rule_set(const std::vector<rule<T>>& rules)
+    {
+        for(auto& r: rules)
+        {
+            add(r);
+        }
+    }
+
+    /*!
+     * \brief adds a rule, after every rule with the same or a higher priority
+     */
+    void add(rule<T> r, int priority = 0, std::vector<guard<T>> guards = {})
+    {
+        if( !r.first || !r.second )
+        {
+            throw InvalidRuleException();
+        }
+        auto pos = std::upper_bound(_rules.begin(), _rules.end(), priority,
+                                    [](int p, const guarded_rule<T>& g){ return p > g.priority; });
+        _rules.insert(pos, guarded_rule<T>{r, priority, guards});
+    }
+
+    /*!
+     * \brief the native evaluators, tried before any rule
+     */
+    evaluators<T>& natives() {return _natives;}
+    const evaluators<T>& natives() const {return _natives;}
+
+    /*!
+     * \brief folds t if it can, otherwise tries each rule at the root of t, in priority order
+     * \param term_ptr<T> t is the term to rewrite
+     * \param term_ptr<T>& out gets the literal, or the instantiated right hand side
+     * \param size_t& fired gets the index of the rule in priority order, or folded
+     *
+     * \return bool if t was folded, or a rule matched and all its guards passed
+     */
+    bool apply(const term_ptr<T>& t, term_ptr<T>& out, size_t& fired) const
+    {
+        if( _natives.fold(t, out) )
+        {
+            fired = folded;
+            return true;
+        }
+        for(size_t i = 0; i < _rules.size(); ++i)
+        {
+            auto& g = _rules[i];
+            Sub<T> sigma;
+            if( !match(*g.r.first, t, sigma) )
+            {
+                continue;
+            }
+            bool pass = true;
+            for(auto& check: g.guards)
+            {
+                if( !check(sigma) )
+                {
+                    pass = false;
+                    break;
+                }
+            }
+            if( pass )
+            {
+                out = g.r.second->rewrite(sigma);
+                fired = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool apply(const term_ptr<T>& t, term_ptr<T>& out) const
+    {
+        size_t fired;
+        return apply(t, out, fired);
+    }
+
+    // What apply says fired when the natives folded the term
+    static constexpr size_t folded = size_t(-1);
+
+    size_t size() const {return _rules.size();}
+    const rule<T>& operator[](size_t i) const {return _rules[i].r;}
+    auto begin() const {return _rules.begin();}
+    auto end() const {return _rules.end();}
+
+private:
+    std::vector<guarded_rule<T>> _rules;
+    evaluators<T> _natives;
+};
+
+/*!
+ * \brief tries each rule at the root of t, first match wins
+ * \param size_t& fired gets the index of the rule that matched
+ */
+template<typename T>
+bool apply(const std::vector<rule<T>>& rules, const term_ptr<T>& t, term_ptr<T>& out, size_t& fired)
+{
+    for(size_t i = 0; i < rules.size(); ++i)
+    {
+        Sub<T> sigma;
+        if( match(*rules[i].first, t, sigma) )
+        {
+            out = rules[i].second->rewrite(sigma);
+            fired = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+bool apply(const std::vector<rule<T>>& rules, const term_ptr<T>& t, term_ptr<T>& out)
+{
+    size_t fired;
+    return apply(rules, t, out, fired);
+}
+
+template<typename T>
+bool apply(const rule_set<T>& rules, const term_ptr<T>& t, term_ptr<T>& out, size_t& fired)
+{
+    return rules.apply(t, out, fired);
+}
+
+template<typename T>
+bool apply(const rule_set<T>& rules, const term_ptr<T>& t, term_ptr<T>& out)
+{
+    return rules.apply(t, out);
+}
+
+#endif // RULES_HPP
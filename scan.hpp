@@ -0,0 +1,365 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include "Term.hpp"
+#include "rules.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TERM_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Vectorized redex candidate scanning.
+ *
+ * A term is laid out flat, in preorder, as an array of symbol ids, and the
+ * head symbols of the rules' left hand sides make a small set. Only positions
+ * whose symbol is in that set can possibly be a redex, so the array is scanned
+ * for them (with AVX2 or SSE2 when the CPU has them, picked at run time, and a
+ * plain loop otherwise) and only those positions are handed to match().
+ *
+ * Symbols are the ids from symbol_table, each function node keeps its own once
+ * it has been looked up, so laying a term out again after a rewrite only looks
+ * up the nodes the rewrite built. renormalize lays out the part of the term it
+ * is about to walk, everything not yet marked normalized, and only tries the
+ * rules at the candidates, see normalizer in normalize.hpp.
+ */
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Kernels
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief writes every i with symbols[i] in heads to out, in order
+ * \param const uint32_t* symbols is the flattened term
+ * \param size_t n is the number of symbols
+ * \param const uint32_t* heads is the set of head symbols
+ * \param size_t k is the number of heads
+ * \param uint32_t* out has room for n positions
+ *
+ * \return size_t how many positions were written
+ */
+inline size_t scan_scalar(const uint32_t* symbols, size_t n, const uint32_t* heads, size_t k, uint32_t* out)
+{
+    size_t count = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        bool hit = false;
+        for(size_t h = 0; h < k; ++h)
+        {
+            hit |= symbols[i] == heads[h];
+        }
+        // Always write, only move on when it was a hit
+        out[count] = i;
+        count += hit;
+    }
+    return count;
+}
+
+/*!
+ * \brief scans what's left after a vector loop stopped at i, positions are still from the start
+ */
+inline size_t scan_tail(const uint32_t* symbols, size_t n, size_t i, const uint32_t* heads, size_t k, uint32_t* out)
+{
+    size_t count = scan_scalar(symbols + i, n - i, heads, k, out);
+    for(size_t j = 0; j < count; ++j)
+    {
+        out[j] += i;
+    }
+    return count;
+}
+
+#ifdef TERM_SCAN_X86
+
+// Past this many heads the broadcasts don't fit in registers and the plain loop is as good
+static const size_t scan_max_heads = 16;
+
+__attribute__((target("sse2")))
+inline size_t scan_sse2(const uint32_t* symbols, size_t n, const uint32_t* heads, size_t k, uint32_t* out)
+{
+    __m128i wanted[scan_max_heads];
+    for(size_t h = 0; h < k; ++h)
+    {
+        wanted[h] = _mm_set1_epi32(heads[h]);
+    }
+    size_t count = 0, i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(symbols + i));
+        __m128i hit = _mm_setzero_si128();
+        for(size_t h = 0; h < k; ++h)
+        {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi32(v, wanted[h]));
+        }
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(hit));
+        while( mask )
+        {
+            out[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return count + scan_tail(symbols, n, i, heads, k, out + count);
+}
+
+__attribute__((target("avx2")))
+inline size_t scan_avx2(const uint32_t* symbols, size_t n, const uint32_t* heads, size_t k, uint32_t* out)
+{
+    __m256i wanted[scan_max_heads];
+    for(size_t h = 0; h < k; ++h)
+    {
+        wanted[h] = _mm256_set1_epi32(heads[h]);
+    }
+    size_t count = 0, i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(symbols + i));
+        __m256i hit = _mm256_setzero_si256();
+        for(size_t h = 0; h < k; ++h)
+        {
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(v, wanted[h]));
+        }
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+        while( mask )
+        {
+            out[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return count + scan_tail(symbols, n, i, heads, k, out + count);
+}
+
+#endif // TERM_SCAN_X86
+
+typedef size_t (*scan_kernel)(const uint32_t*, size_t, const uint32_t*, size_t, uint32_t*);
+
+/*!
+ * \brief the best kernel this CPU can run, looked up once
+ */
+inline const char* scan_level()
+{
+#ifdef TERM_SCAN_X86
+    static const char* level = __builtin_cpu_supports("avx2") ? "avx2"
+                             : __builtin_cpu_supports("sse2") ? "sse2" : "scalar";
+    return level;
+#else
+    return "scalar";
+#endif
+}
+
+/*!
+ * \brief scans with the best kernel for this CPU, see scan_scalar
+ */
+inline size_t scan(const uint32_t* symbols, size_t n, const uint32_t* heads, size_t k, uint32_t* out)
+{
+#ifdef TERM_SCAN_X86
+    static const scan_kernel best = __builtin_cpu_supports("avx2") ? scan_avx2
+                                  : __builtin_cpu_supports("sse2") ? scan_sse2 : scan_scalar;
+    if( k <= scan_max_heads )
+    {
+        return best(symbols, n, heads, k, out);
+    }
+#endif
+    return scan_scalar(symbols, n, heads, k, out);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// flat_term
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief the head symbols of a rule set, and which rules go with each
+ */
+template<typename T>
+class rule_heads
+{
+public:
+    rule_heads(const std::vector<rule<T>>& rules)
+    {
+        for(size_t r = 0; r < rules.size(); ++r)
+        {
+            _add(r, rules[r]);
+        }
+    }
+
+    rule_heads(const rule_set<T>& rules)
+    {
+        for(size_t r = 0; r < rules.size(); ++r)
+        {
+            _add(r, rules[r]);
+        }
+        // The natives fold by name under any node of literals, so they can't
+        // narrow it either
+        _folds = !rules.natives().empty();
+    }
+
+    const std::vector<uint32_t>& heads() const {return _heads;}
+    bool everywhere() const {return !_anywhere.empty() || _folds;}
+
+    /*!
+     * \brief the rules that could match at a node with this symbol, in rule order
+     */
+    std::vector<size_t> rules_for(uint32_t id) const
+    {
+        std::vector<size_t> ret = _anywhere;
+        auto found = _by_head.find(id);
+        if( found != _by_head.end() )
+        {
+            ret.insert(ret.end(), found->second.begin(), found->second.end());
+            std::sort(ret.begin(), ret.end());
+        }
+        return ret;
+    }
+
+private:
+    void _add(size_t i, const rule<T>& r)
+    {
+        uint32_t id = r.first->symbol();
+        if( id == symbol_table::variable_id )
+        {
+            // A bare variable matches anything, so it can't narrow the scan
+            _anywhere.push_back(i);
+            return;
+        }
+        if( _by_head.find(id) == _by_head.end() )
+        {
+            _heads.push_back(id);
+        }
+        _by_head[id].push_back(i);
+    }
+
+    std::vector<uint32_t> _heads;
+    std::vector<size_t> _anywhere;
+    bool _folds{false};
+    std::unordered_map<uint32_t, std::vector<size_t>> _by_head;
+};
+
+/*!
+ * \brief a term laid out in preorder, the same order term_iterator walks it
+ *
+ * The term has to outlive the layout, it keeps pointers into the nodes'
+ * children rather than a count on every node.
+ */
+template<typename T>
+class flat_term
+{
+public:
+    /*!
+     * \param bool dirty_only lays a subterm marked normalized out as the one
+     * position, leaving out everything under it, the way renormalize walks it
+     */
+    flat_term(const term_ptr<T>& root, bool dirty_only = false):
+        _root{root}
+    {
+        // The root isn't anyone's child, node() finds it in _root
+        std::vector< std::pair<const term_ptr<T>*, uint32_t> > stack{ {nullptr, 0} };
+        std::vector<uint32_t> parents{ uint32_t(-1) };
+        while( !stack.empty() )
+        {
+            const term_ptr<T>* at = stack.back().first;
+            uint32_t ordinal = stack.back().second;
+            uint32_t parent = parents.back();
+            stack.pop_back();
+            parents.pop_back();
+
+            term<T>& t = at ? **at : *_root;
+            uint32_t here = _nodes.size();
+            _symbols.push_back(t.symbol());
+            _nodes.push_back(at);
+            _parent.push_back(parent);
+            _ordinal.push_back(ordinal);
+            if( dirty_only && t.normalized() )
+            {
+                continue;
+            }
+
+            // Push backwards so the first child comes off first
+            auto& children = t.children();
+            for(size_t i = children.size(); i > 0; --i)
+            {
+                stack.emplace_back(&children[i-1], i);
+                parents.push_back(here);
+            }
+        }
+    }
+
+    size_t size() const {return _symbols.size();}
+    const uint32_t* symbols() const {return _symbols.data();}
+    const term_ptr<T>& node(size_t i) const {return _nodes[i] ? *_nodes[i] : _root;}
+
+    /*!
+     * \brief the positions whose symbol is one of the heads
+     */
+    std::vector<uint32_t> candidates(const rule_heads<T>& heads) const
+    {
+        std::vector<uint32_t> ret(_symbols.size());
+        if( heads.everywhere() )
+        {
+            for(size_t i = 0; i < ret.size(); ++i)
+            {
+                ret[i] = i;
+            }
+            return ret;
+        }
+        ret.resize(scan(_symbols.data(), _symbols.size(), heads.heads().data(), heads.heads().size(), ret.data()));
+        return ret;
+    }
+
+    /*!
+     * \brief the path to position i, as term::rewrite wants it
+     */
+    path path_to(size_t i) const
+    {
+        path p;
+        for(; _parent[i] != uint32_t(-1); i = _parent[i])
+        {
+            p.push_front(_ordinal[i]);
+        }
+        return p;
+    }
+
+private:
+    term_ptr<T> _root;
+    std::vector<uint32_t> _symbols;
+    std::vector<const term_ptr<T>*> _nodes;
+    std::vector<uint32_t> _parent;
+    std::vector<uint32_t> _ordinal;
+};
+
+/*!
+ * \brief every redex in the term, found by scanning for candidates and only matching those
+ *
+ * \return std::vector of (position, rule index) pairs in preorder, with the
+ * first rule that matches at each position
+ */
+template<typename T>
+std::vector< std::pair<uint32_t, size_t> > redexes(const flat_term<T>& flat, const std::vector<rule<T>>& rules,
+                                                   const rule_heads<T>& heads)
+{
+    std::vector< std::pair<uint32_t, size_t> > ret;
+    for(auto pos: flat.candidates(heads))
+    {
+        // Variables aren't redexes, reduce() skips them too
+        if( flat.symbols()[pos] == symbol_table::variable_id )
+        {
+            continue;
+        }
+        for(auto r: heads.rules_for(flat.symbols()[pos]))
+        {
+            Sub<T> sigma;
+            if( match(*rules[r].first, flat.node(pos), sigma) )
+            {
+                ret.emplace_back(pos, r);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+#endif // SCAN_HPP
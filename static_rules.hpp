@@ -0,0 +1,213 @@
+#ifndef STATIC_RULES_HPP
+#define STATIC_RULES_HPP
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <utility>
+#include "Term.hpp"
+
+/**
+ * Rules fixed at compile time.
+ *
+ * A pattern is a type built from pvar, plit and pfun, and a rule is a pair of
+ * them, so the contra rule ->(a, false) => !(a) from TermsTest is
+ *
+ *     struct arrow_sym { static constexpr const char* name = "->"; };
+ *     struct not_sym   { static constexpr const char* name = "!"; };
+ *     typedef static_rule< pfun<arrow_sym, pvar<'a'>, plit<false>>,
+ *                          pfun<not_sym, pvar<'a'>> > contra;
+ *
+ * The compiler writes the matching and instantiating code for each rule, so
+ * there's no walking of a rule term and no Sub, the bindings sit in a small
+ * array on the stack indexed by the variable's letter, just big enough for
+ * the letters the rule uses. static_rules<R...> tries its rules
+ * in order, first match wins, exactly as a std::vector<rule<T>> would, and
+ * dynamic() gives back that vector so the two can be checked against each other.
+ */
+
+template<typename T, size_t N>
+using bindings = std::array<term_ptr<T>, N>;
+
+/*!
+ * \brief how many binding slots the patterns need between them
+ */
+template<typename... Patterns>
+constexpr size_t slots_for()
+{
+    size_t n = 0;
+    ((n = Patterns::slots > n ? Patterns::slots : n), ...);
+    return n;
+}
+
+/*!
+ * \brief the letters the patterns use between them, bit 0 for a and so on
+ */
+template<typename... Patterns>
+constexpr uint32_t binds_for()
+{
+    return (uint32_t(0) | ... | Patterns::binds);
+}
+
+/*!
+ * \brief a pattern variable, pvar<'a'> is the variable a
+ */
+template<char Name>
+struct pvar
+{
+    static_assert(Name >= 'a' && Name <= 'z', "pattern variables are single lower case letters");
+    static const size_t slots = Name - 'a' + 1;
+    static const uint32_t binds = uint32_t(1) << (Name - 'a');
+
+    template<typename T, typename B>
+    static bool match(const term_ptr<T>& t, B& b)
+    {
+        term_ptr<T>& slot = b[Name - 'a'];
+        if( slot )
+        {
+            return slot == t || *slot == *t;
+        }
+        slot = t;
+        return true;
+    }
+
+    template<typename T, typename B>
+    static term_ptr<T> build(B& b)
+    {
+        return b[Name - 'a'];
+    }
+
+    template<typename T>
+    static term_ptr<T> dynamic()
+    {
+        return make_term<variable<T>>(std::string(1, Name));
+    }
+};
+
+/*!
+ * \brief a pattern literal, plit<false> is the literal false
+ */
+template<auto Value>
+struct plit
+{
+    static const size_t slots = 0;
+    static const uint32_t binds = 0;
+
+    template<typename T, typename B>
+    static bool match(const term_ptr<T>& t, B&)
+    {
+        return t->kind() == term_kind::literal && static_cast<literal<T>&>(*t).value() == T(Value);
+    }
+
+    template<typename T, typename B>
+    static term_ptr<T> build(B&)
+    {
+        return make_term<literal<T>>(T(Value));
+    }
+
+    template<typename T>
+    static term_ptr<T> dynamic()
+    {
+        return make_term<literal<T>>(T(Value));
+    }
+};
+
+/*!
+ * \brief a pattern function, Sym has a static name, the arity is the number of Args
+ */
+template<typename Sym, typename... Args>
+struct pfun
+{
+    static const size_t slots = slots_for<Args...>();
+    static const uint32_t binds = binds_for<Args...>();
+
+    template<typename T, typename B>
+    static bool match(const term_ptr<T>& t, B& b)
+    {
+        if( t->kind() != term_kind::function )
+        {
+            return false;
+        }
+        auto& f = static_cast<function<T>&>(*t);
+        if( f.children().size() != sizeof...(Args) || f.name() != Sym::name )
+        {
+            return false;
+        }
+        return _match<T>(f.children(), b, std::index_sequence_for<Args...>{});
+    }
+
+    template<typename T, typename B>
+    static term_ptr<T> build(B& b)
+    {
+        return make_term<function<T>>(Sym::name, sizeof...(Args), std::vector< term_ptr<T> >{ Args::template build<T>(b)... });
+    }
+
+    template<typename T>
+    static term_ptr<T> dynamic()
+    {
+        return make_term<function<T>>(Sym::name, sizeof...(Args), std::vector< term_ptr<T> >{ Args::template dynamic<T>()... });
+    }
+
+private:
+    template<typename T, typename B, size_t... I>
+    static bool _match(std::vector< term_ptr<T> >& children, B& b, std::index_sequence<I...>)
+    {
+        // Left to right, stopping at the first child that doesn't match
+        return (Args::template match<T>(children[I], b) && ...);
+    }
+};
+
+template<typename Lhs, typename Rhs>
+struct static_rule
+{
+    static_assert((Rhs::binds & ~Lhs::binds) == 0, "the right hand side uses a variable the left hand side doesn't bind");
+
+    template<typename T>
+    static bool apply(const term_ptr<T>& t, term_ptr<T>& out)
+    {
+        bindings<T, Lhs::slots> b;
+        if( !Lhs::template match<T>(t, b) )
+        {
+            return false;
+        }
+        out = Rhs::template build<T>(b);
+        return true;
+    }
+
+    template<typename T>
+    static rule<T> dynamic()
+    {
+        return rule<T>(Lhs::template dynamic<T>(), Rhs::template dynamic<T>());
+    }
+};
+
+template<typename... Rules>
+struct static_rules
+{
+    /*!
+     * \brief tries each rule at the root of t, first match wins
+     */
+    template<typename T>
+    bool apply(const term_ptr<T>& t, term_ptr<T>& out) const
+    {
+        return (Rules::template apply<T>(t, out) || ...);
+    }
+
+    /*!
+     * \brief the same rules as a std::vector<rule<T>>, in the same order
+     */
+    template<typename T>
+    static std::vector<rule<T>> dynamic()
+    {
+        return std::vector<rule<T>>{ Rules::template dynamic<T>()... };
+    }
+};
+
+template<typename T, typename... Rules>
+bool apply(const static_rules<Rules...>& rules, const term_ptr<T>& t, term_ptr<T>& out)
+{
+    return rules.template apply<T>(t, out);
+}
+
+#endif // STATIC_RULES_HPP
@@ -0,0 +1,416 @@
+#ifndef STEPS_HPP
+#define STEPS_HPP
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define TERM_COROUTINES
+
+#include <deque>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <thread>
+#include <optional>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <exception>
+#include <coroutine>
+#include <functional>
+#include <condition_variable>
+#include "Term.hpp"
+#include "rules.hpp"
+#include "normalize.hpp"
+
+/**
+ * Normalization one step at a time, as a C++20 coroutine.
+ *
+ * steps(t, rules) gives back a step_generator that hasn't done anything yet.
+ * Each next() runs normalization on until the next rule fires and stops there,
+ * with the rule, the position and the whole term after the step to look at.
+ * It runs normalize()'s own walk, a normalizer from normalize.hpp stopped at
+ * every step, so the steps are exactly the ones normalize() takes, in the same order, and
+ * when next() says there are no more, result() is what normalize() would have
+ * returned.
+ *
+ * A stretch with no redex can walk a lot of nodes before the next step, so
+ * steps() can also be told to pause every so many nodes. resume() stops at
+ * pauses and steps alike, paused() says which, and next() and the iterators
+ * go straight past the pauses.
+ *
+ * step_scheduler runs many of these on a few threads. Each reduction gets a
+ * quantum of steps and pauses and then goes to the back of the queue, so a
+ * long reduction can't hold up the short ones behind it, even where it isn't
+ * rewriting anything.
+ *
+ * Only here when the compiler does coroutines, TERM_COROUTINES says so.
+ */
+
+template<typename T>
+struct rewrite_step
+{
+    size_t rule;        // as apply() reports it, rule_set<T>::folded for a fold
+    path at;
+    term_ptr<T> term;   // the whole term after this step
+};
+
+/*!
+ * \brief what steps() yields when it pauses without a step
+ */
+struct step_pause {};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// step_generator
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+class step_generator
+{
+public:
+    struct promise_type
+    {
+        rewrite_step<T> _current;
+        term_ptr<T> _result;
+        std::exception_ptr _error;
+        bool _paused{false};
+
+        step_generator get_return_object()
+        {
+            return step_generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {return {};}
+        std::suspend_always final_suspend() noexcept {return {};}
+        std::suspend_always yield_value(rewrite_step<T>&& s)
+        {
+            _current = std::move(s);
+            _paused = false;
+            return {};
+        }
+        std::suspend_always yield_value(step_pause)
+        {
+            _paused = true;
+            return {};
+        }
+        void return_value(term_ptr<T> result){ _result = std::move(result); }
+        void unhandled_exception(){ _error = std::current_exception(); }
+    };
+
+    class iterator
+    {
+    public:
+        iterator(step_generator* g): _g{g} {}
+        const rewrite_step<T>& operator*() const {return _g->step();}
+        iterator& operator++(){ if( !_g->next() ) _g = nullptr; return *this; }
+        bool operator==(const iterator& rhs) const {return _g == rhs._g;}
+        bool operator!=(const iterator& rhs) const {return _g != rhs._g;}
+    private:
+        step_generator* _g;
+    };
+
+    step_generator(step_generator&& rhs) noexcept: _h{rhs._h} { rhs._h = nullptr; }
+    step_generator& operator=(step_generator&& rhs) noexcept
+    {
+        std::swap(_h, rhs._h);
+        return *this;
+    }
+    step_generator(const step_generator&) = delete;
+    step_generator& operator=(const step_generator&) = delete;
+    ~step_generator(){ if( _h ) _h.destroy(); }
+
+    /*!
+     * \brief runs to the next step, past any pauses
+     *
+     * \return bool if there was one, false once the term is normal
+     */
+    bool next()
+    {
+        while( resume() )
+        {
+            if( !paused() )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*!
+     * \brief runs to the next step or pause, whichever comes first
+     *
+     * \return bool if it stopped at either, false once the term is normal
+     */
+    bool resume()
+    {
+        if( _h.done() )
+        {
+            return false;
+        }
+        _h.resume();
+        if( _h.promise()._error )
+        {
+            std::rethrow_exception(_h.promise()._error);
+        }
+        return !_h.done();
+    }
+
+    bool done() const {return _h.done();}
+
+    /*!
+     * \brief if resume() stopped at a pause, step() is still the step before it
+     */
+    bool paused() const {return _h.promise()._paused;}
+
+    /*!
+     * \brief the step next() stopped at
+     */
+    const rewrite_step<T>& step() const {return _h.promise()._current;}
+
+    /*!
+     * \brief the normal form, once next() has returned false
+     */
+    const term_ptr<T>& result() const {return _h.promise()._result;}
+
+    iterator begin(){ return next() ? iterator(this) : end(); }
+    iterator end(){ return iterator(nullptr); }
+
+private:
+    explicit step_generator(std::coroutine_handle<promise_type> h): _h{h} {}
+
+    std::coroutine_handle<promise_type> _h;
+};
+
+/*!
+ * \brief the Pause steps() runs its normalizer with
+ */
+template<typename T>
+struct step_pacer
+{
+    static constexpr bool wants_rule = true;
+    term_ptr<T> whole;
+    size_t visits;
+    size_t walked;
+    bool stepped;
+    size_t rule;
+    path at;
+
+    bool fired(size_t r, const path& p)
+    {
+        stepped = true;
+        rule = r;
+        at = p;
+        walked = 0;
+        return true;
+    }
+    bool visited()
+    {
+        if( visits && ++walked == visits )
+        {
+            walked = 0;
+            return true;
+        }
+        return false;
+    }
+};
+
+/*!
+ * \brief normalizes t from scratch, stopping after every step
+ * \param term_ptr<T> t is the term to be normalized
+ * \param Rules& rules a std::vector<rule<T>> or a rule_set<T>, it has to
+ * outlive the generator
+ * \param size_t visits pauses after that many nodes with no step, 0 never pauses
+ *
+ * \return step_generator<T> which hasn't started yet
+ */
+template<typename T, typename Rules>
+step_generator<T> steps(term_ptr<T> t, const Rules& rules, size_t visits = 0)
+{
+    // normalize's own walk, stopped at every step and every visits nodes
+    invalidate_all(t);
+    no_trace none;
+    normalizer<T, Rules, no_trace> walk(t, rules, none);
+    step_pacer<T> pace{t, visits, 0, false, 0, path()};
+    while( true )
+    {
+        pace.stepped = false;
+        if( walk.run(pace) )
+        {
+            co_return walk.result();
+        }
+        if( !pace.stepped )
+        {
+            co_yield step_pause{};
+            continue;
+        }
+        pace.whole = replace_at(pace.whole, pace.at, 0, walk.current());
+        // Named, g++ 12 frees a braced temporary in co_yield twice
+        rewrite_step<T> step{pace.rule, pace.at, pace.whole};
+        co_yield std::move(step);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// step_scheduler
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief normalizes many terms on a few threads, round robin a quantum of steps at a time
+ *
+ * The rules are only ever read, so every reduction shares them, but each term
+ * handed to submit() belongs to its reduction from then on and mustn't share
+ * nodes with another, normalizing marks them.
+ */
+template<typename T, typename Rules>
+class step_scheduler
+{
+public:
+    typedef std::function<void(const rewrite_step<T>&)> observer;
+
+    /*!
+     * \param Rules& rules has to outlive the scheduler
+     * \param unsigned threads is how many threads to use, 0 for one per core
+     * \param size_t quantum is how many steps a reduction gets before the next one's turn
+     * \param size_t visits is how many nodes a reduction walks without a step
+     * before that counts against its quantum as a step would
+     */
+    step_scheduler(const Rules& rules, unsigned threads = 0, size_t quantum = 64, size_t visits = 1024):
+        _rules(rules),
+        _quantum{quantum ? quantum : 1},
+        _visits{visits ? visits : 1}
+    {
+        unsigned n = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        for(unsigned i = 0; i < n; ++i)
+        {
+            _workers.emplace_back([this](){ _run(); });
+        }
+    }
+
+    ~step_scheduler()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> hold(_lock);
+            _stop = true;
+        }
+        _ready.notify_all();
+        for(auto& w: _workers)
+        {
+            w.join();
+        }
+    }
+
+    step_scheduler(const step_scheduler&) = delete;
+    step_scheduler& operator=(const step_scheduler&) = delete;
+
+    /*!
+     * \brief queues t to be normalized
+     * \param observer watch is called with each step, on whichever thread ran it
+     *
+     * \return std::future with the normal form
+     */
+    std::future< term_ptr<T> > submit(term_ptr<T> t, observer watch = observer())
+    {
+        std::unique_ptr<task> job(new task{steps(std::move(t), _rules, _visits), std::move(watch), {}});
+        std::future< term_ptr<T> > ret = job->done.get_future();
+        {
+            std::lock_guard<std::mutex> hold(_lock);
+            _queue.push_back(std::move(job));
+            ++_pending;
+        }
+        _ready.notify_one();
+        return ret;
+    }
+
+    /*!
+     * \brief blocks until everything submitted so far is done
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> hold(_lock);
+        _idle.wait(hold, [this](){ return _pending == 0; });
+    }
+
+private:
+    struct task
+    {
+        std::optional< step_generator<T> > gen;
+        observer watch;
+        std::promise< term_ptr<T> > done;
+    };
+
+    void _run()
+    {
+        while( true )
+        {
+            std::unique_ptr<task> job;
+            {
+                std::unique_lock<std::mutex> hold(_lock);
+                _ready.wait(hold, [this](){ return _stop || !_queue.empty(); });
+                if( _queue.empty() )
+                {
+                    return;
+                }
+                job = std::move(_queue.front());
+                _queue.pop_front();
+            }
+
+            // One quantum of steps and pauses, then to the back of the queue unless it's finished
+            bool finished = false;
+            try
+            {
+                for(size_t n = 0; n < _quantum; ++n)
+                {
+                    if( !job->gen->resume() )
+                    {
+                        // Let go of the reduction's handles before anyone else gets the result,
+                        // a term_handle count isn't atomic
+                        term_ptr<T> result = job->gen->result();
+                        job->gen.reset();
+                        finished = true;
+                        job->done.set_value(std::move(result));
+                        break;
+                    }
+                    if( job->watch && !job->gen->paused() )
+                    {
+                        job->watch(job->gen->step());
+                    }
+                }
+            }
+            catch(...)
+            {
+                job->gen.reset();
+                finished = true;
+                job->done.set_exception(std::current_exception());
+            }
+
+            std::lock_guard<std::mutex> hold(_lock);
+            if( finished )
+            {
+                job.reset();
+                if( --_pending == 0 )
+                {
+                    _idle.notify_all();
+                }
+            }
+            else
+            {
+                _queue.push_back(std::move(job));
+                _ready.notify_one();
+            }
+        }
+    }
+
+    const Rules& _rules;
+    size_t _quantum;
+    size_t _visits;
+
+    std::mutex _lock;
+    std::condition_variable _ready;
+    std::condition_variable _idle;
+    std::deque< std::unique_ptr<task> > _queue;
+    size_t _pending{0};
+    bool _stop{false};
+    std::vector<std::thread> _workers;
+};
+
+#endif // coroutines
+
+#endif // STEPS_HPP
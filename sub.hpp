@@ -5,12 +5,7 @@
 #include<iostream>
 #include<utility>
 #include<memory>
-
-template<typename T>
-class term;
-
-template<typename T>
-using term_ptr = std::shared_ptr<term<T>>;
+#include "handle.hpp"
 
 /**
  * a simple implementation of a substitution class.
@@ -36,6 +31,14 @@ public:
     {
         _map[s] = t;
     }
+    bool contains(const std::string& s) const
+    {
+        return _map.find(s) != _map.end();
+    }
+    void erase(const std::string& s)
+    {
+        _map.erase(s);
+    }
 
     // print the substitution so I can verify that unify works
     void print()
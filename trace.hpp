@@ -0,0 +1,580 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <condition_variable>
+#include "Term.hpp"
+#include "rules.hpp"
+
+/**
+ * A binary trace of reductions, and its replay.
+ *
+ * Pass a trace_writer to reduce() or normalize() and every rule that fires is
+ * written down as (step, rule, position). Each writer belongs to one thread
+ * and writes into its own ring buffer, with no locks, and the trace_log that
+ * handed it out empties every ring into its stream from a thread of its own.
+ * A step that finds its ring full is dropped and counted, the reduction
+ * never waits on the log, but it isn't dropped silently: the ring always keeps
+ * room for a lost marker, and the first step lost goes in as one. Runs that
+ * start while steps are being lost are counted, and the count goes in ahead of
+ * the next record that fits, or at the end of the stream when the log goes away.
+ *
+ * Each record is a handful of varints, the step, the rule plus two (1 for a
+ * rule_set fold), the depth of the position and then the position itself, at
+ * any depth. A lost marker is the step, a 0 and a count of runs. With no runs
+ * it stands for that step and every one after it up to the next record; with
+ * n runs, n runs started and lost everything from their step 0 on, and the
+ * last of them carries on with the next record if that isn't a step 0. In the
+ * stream they come in chunks of (writer, length, bytes).
+ *
+ * read_trace() gives the runs back, with a trace_lost step for each marker, so
+ * even a run lost whole is there, as a run of just a trace_lost. replay()
+ * rebuilds every term along the way from the starting term and the same rules.
+ * Both throw TraceGapException rather than skip over a gap. It doesn't search for redexes
+ * or match, each step already says which rule and where, the bindings are just
+ * read off the term under the rule's left hand side.
+ */
+
+struct trace_step
+{
+    uint32_t step;
+    uint32_t rule;      // trace_fold for a rule_set fold, trace_lost from here on steps were lost
+    path at;
+};
+
+static constexpr uint32_t trace_fold = uint32_t(-1);
+static constexpr uint32_t trace_lost = uint32_t(-2);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// trace_ring
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief a single producer single consumer ring of bytes
+ */
+class trace_ring
+{
+public:
+    /*!
+     * \param size_t capacity is rounded up to a power of two
+     */
+    trace_ring(size_t capacity)
+    {
+        size_t n = 64;
+        while( n < capacity )
+        {
+            n <<= 1;
+        }
+        _bytes.reset(new uint8_t[n]);
+        _mask = n - 1;
+    }
+
+    /*!
+     * \brief writes all n bytes or none of them, for the producer only
+     * \param size_t keep is how many bytes have to be left free after them
+     *
+     * \return bool if they fit
+     */
+    bool push(const uint8_t* bytes, size_t n, size_t keep = 0)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        if( n + keep > _mask + 1 - (head - tail) )
+        {
+            return false;
+        }
+        for(size_t i = 0; i < n; ++i)
+        {
+            _bytes[(head + i) & _mask] = bytes[i];
+        }
+        _head.store(head + n, std::memory_order_release);
+        return true;
+    }
+
+    /*!
+     * \brief moves everything written so far onto the end of out, for the consumer only
+     */
+    size_t drain(std::vector<uint8_t>& out)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_acquire);
+        // At most two pieces, up to the end of the buffer and then from the start
+        size_t from = tail & _mask;
+        size_t first = std::min(head - tail, _mask + 1 - from);
+        out.insert(out.end(), _bytes.get() + from, _bytes.get() + from + first);
+        out.insert(out.end(), _bytes.get(), _bytes.get() + (head - tail - first));
+        _tail.store(head, std::memory_order_release);
+        return head - tail;
+    }
+
+private:
+    std::unique_ptr<uint8_t[]> _bytes;
+    size_t _mask;
+
+    // Apart so the two threads don't fight over a cache line
+    alignas(64) std::atomic<size_t> _head{0};
+    alignas(64) std::atomic<size_t> _tail{0};
+};
+
+inline void put_varint(uint8_t*& out, uint64_t v)
+{
+    while( v >= 0x80 )
+    {
+        *out++ = uint8_t(v) | 0x80;
+        v >>= 7;
+    }
+    *out++ = uint8_t(v);
+}
+
+inline bool get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& v)
+{
+    v = 0;
+    for(unsigned shift = 0; in != end && shift < 64; shift += 7)
+    {
+        uint8_t b = *in++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if( !(b & 0x80) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// trace_writer
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief the trace reduce() and normalize() write to, one per thread
+ */
+class trace_writer
+{
+public:
+    static constexpr bool enabled = true;
+
+    trace_writer(uint32_t id, size_t capacity):
+        _id{id}, _ring{capacity}
+    {}
+
+    void begin()
+    {
+        _step = 0;
+        _counted = false;
+    }
+    void enter(uint32_t child){ _at.push_back(child); }
+    void leave(){ _at.pop_back(); }
+
+    void fired(size_t rule)
+    {
+        // Positions deeper than this are written from a buffer on the heap, kept for next time
+        static const size_t deepest = 64;
+        uint8_t small[marker + 10 * (3 + deepest)];
+        uint8_t* record = small;
+        if( _at.size() > deepest )
+        {
+            _spill.resize(marker + 10 * (3 + _at.size()));
+            record = _spill.data();
+        }
+
+        uint32_t step = _step++;
+        uint8_t* out = record;
+        if( _losing && _runs_lost )
+        {
+            // Runs started and were lost since the marker, say how many first
+            _put_marker(out, 0, _runs_lost);
+        }
+        put_varint(out, step);
+        put_varint(out, uint32_t(rule + 2));
+        put_varint(out, _at.size());
+        for(auto child: _at)
+        {
+            put_varint(out, child);
+        }
+
+        if( _ring.push(record, out - record, marker) )
+        {
+            _losing = false;
+            _runs_lost = 0;
+            _counted = true;
+            return;
+        }
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        if( _losing )
+        {
+            // A run started since the marker counts once its first step is lost
+            _runs_lost += !_counted;
+            _counted = true;
+            return;
+        }
+
+        // Always fits, every record leaves room for it. At a step 0 the run
+        // itself is new, so the marker says it started.
+        uint8_t lost[marker];
+        uint8_t* end = lost;
+        _put_marker(end, step, step == 0);
+        _ring.push(lost, end - lost);
+        _losing = true;
+        _runs_lost = 0;
+        _counted = true;
+    }
+
+    uint32_t id() const {return _id;}
+    size_t dropped() const {return _dropped.load(std::memory_order_relaxed);}
+
+private:
+    friend class trace_log;
+
+    // A lost marker at its longest, a step, a 0 and a count of runs
+    static const size_t marker = 11;
+
+    static void _put_marker(uint8_t*& out, uint32_t step, uint32_t runs)
+    {
+        put_varint(out, step);
+        put_varint(out, 0);
+        put_varint(out, runs);
+    }
+
+    uint32_t _id;
+    trace_ring _ring;
+    std::vector<uint32_t> _at;
+    std::vector<uint8_t> _spill;
+    uint32_t _step{0};
+    bool _losing{false};      // the last step was lost, and a marker is in for it
+    uint32_t _runs_lost{0};   // runs started since the marker, with steps lost
+    bool _counted{false};     // the current run is the marker's or in _runs_lost
+    std::atomic<size_t> _dropped{0};
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// trace_log
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief hands out writers and empties them into a stream in the background
+ */
+class trace_log
+{
+public:
+    /*!
+     * \param std::ostream& out gets the binary trace, it must outlive the log
+     * \param size_t capacity is the size of each writer's ring in bytes
+     * \param std::chrono::milliseconds every is how often the rings are emptied
+     */
+    trace_log(std::ostream& out, size_t capacity = 1 << 16,
+              std::chrono::milliseconds every = std::chrono::milliseconds(10)):
+        _out(out), _capacity{capacity}, _every{every}
+    {
+        _flusher = std::thread([this](){ _run(); });
+    }
+
+    ~trace_log()
+    {
+        {
+            std::lock_guard<std::mutex> hold(_lock);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _flusher.join();
+        flush();
+
+        // Runs lost after the last record that fit, every writer is done by now
+        for(auto& w: _writers)
+        {
+            if( !w->_losing || !w->_runs_lost )
+            {
+                continue;
+            }
+            uint8_t chunk[2 * 10 + trace_writer::marker];
+            uint8_t* lost = chunk + 20;
+            uint8_t* end = lost;
+            trace_writer::_put_marker(end, 0, w->_runs_lost);
+            uint8_t* out = chunk;
+            put_varint(out, w->_id);
+            put_varint(out, end - lost);
+            _out.write(reinterpret_cast<const char*>(chunk), out - chunk);
+            _out.write(reinterpret_cast<const char*>(lost), end - lost);
+        }
+        _out.flush();
+    }
+
+    trace_log(const trace_log&) = delete;
+    trace_log& operator=(const trace_log&) = delete;
+
+    /*!
+     * \brief a new writer, to be used by one thread at a time, it lives as long as the log
+     */
+    trace_writer& writer()
+    {
+        std::lock_guard<std::mutex> hold(_lock);
+        _writers.emplace_back(new trace_writer(_writers.size(), _capacity));
+        return *_writers.back();
+    }
+
+    /*!
+     * \brief empties every ring into the stream now
+     */
+    void flush()
+    {
+        std::lock_guard<std::mutex> hold(_lock);
+        _flush();
+    }
+
+private:
+    void _run()
+    {
+        std::unique_lock<std::mutex> hold(_lock);
+        while( !_stop )
+        {
+            _wake.wait_for(hold, _every);
+            _flush();
+        }
+    }
+
+    // Called with _lock held
+    void _flush()
+    {
+        for(auto& w: _writers)
+        {
+            _chunk.clear();
+            if( !w->_ring.drain(_chunk) )
+            {
+                continue;
+            }
+            uint8_t header[20];
+            uint8_t* out = header;
+            put_varint(out, w->_id);
+            put_varint(out, _chunk.size());
+            _out.write(reinterpret_cast<const char*>(header), out - header);
+            _out.write(reinterpret_cast<const char*>(_chunk.data()), _chunk.size());
+        }
+        _out.flush();
+    }
+
+    std::ostream& _out;
+    size_t _capacity;
+    std::chrono::milliseconds _every;
+
+    std::mutex _lock;
+    std::condition_variable _wake;
+    bool _stop{false};
+    std::vector<std::unique_ptr<trace_writer>> _writers;
+    std::vector<uint8_t> _chunk;
+    std::thread _flusher;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Reading and replaying
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief reads a whole trace back
+ *
+ * \return the runs, each a list of steps, writer by writer and in the order
+ * each writer ran them, with a trace_lost step where the writer lost some
+ * \throw TraceGapException if steps are missing with no marker for them
+ */
+inline std::vector< std::vector<trace_step> > read_trace(std::istream& in)
+{
+    std::vector<uint8_t> all((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    // Put each writer's chunks back together
+    std::vector< std::vector<uint8_t> > writers;
+    const uint8_t* p = all.data();
+    const uint8_t* end = p + all.size();
+    uint64_t id, length;
+    while( get_varint(p, end, id) && get_varint(p, end, length) && length <= uint64_t(end - p) )
+    {
+        if( id >= writers.size() )
+        {
+            writers.resize(id + 1);
+        }
+        writers[id].insert(writers[id].end(), p, p + length);
+        p += length;
+    }
+    if( p != end )
+    {
+        // Cut off in the middle of a chunk
+        throw TraceGapException();
+    }
+
+    std::vector< std::vector<trace_step> > runs;
+    for(auto& bytes: writers)
+    {
+        const uint8_t* q = bytes.data();
+        const uint8_t* stop = q + bytes.size();
+        uint64_t step, code, depth, child, started;
+        uint64_t next = 0;      // the step the run is up to
+        bool lost = false;      // after a marker, any later step can come next
+        bool first = true;
+        while( q != stop )
+        {
+            if( !get_varint(q, stop, step) || !get_varint(q, stop, code) )
+            {
+                throw TraceGapException();
+            }
+            if( code == 0 )
+            {
+                if( !get_varint(q, stop, started) || (started != 0) != (step == 0) )
+                {
+                    throw TraceGapException();
+                }
+                for(uint64_t i = 0; i < started; ++i)
+                {
+                    // Runs lost from their very first step
+                    runs.emplace_back(1, trace_step{0, trace_lost, path()});
+                }
+                if( started == 0 && (first || step < next) )
+                {
+                    throw TraceGapException();
+                }
+                if( started == 0 )
+                {
+                    runs.back().push_back(trace_step{uint32_t(step), trace_lost, path()});
+                }
+                first = false;
+                next = step + 1;
+                lost = true;
+                continue;
+            }
+            if( step == 0 )
+            {
+                runs.emplace_back();
+            }
+            else if( first || (lost ? step < next : step != next) )
+            {
+                throw TraceGapException();
+            }
+            first = false;
+            next = step + 1;
+            lost = false;
+
+            trace_step s{uint32_t(step), code == 1 ? trace_fold : uint32_t(code - 2), path()};
+            if( !get_varint(q, stop, depth) )
+            {
+                throw TraceGapException();
+            }
+            for(uint64_t i = 0; i < depth; ++i)
+            {
+                if( !get_varint(q, stop, child) )
+                {
+                    throw TraceGapException();
+                }
+                s.at.push_back(child);
+            }
+            runs.back().push_back(std::move(s));
+        }
+    }
+    return runs;
+}
+
+template<typename T>
+const rule<T>& traced_rule(const std::vector<rule<T>>& rules, uint32_t i) {return rules.at(i);}
+
+template<typename T>
+const rule<T>& traced_rule(const rule_set<T>& rules, uint32_t i)
+{
+    if( i >= rules.size() )
+    {
+        throw InvalidRuleException();
+    }
+    return rules[i];
+}
+
+template<typename T>
+bool traced_fold(const std::vector<rule<T>>&, const term_ptr<T>&, term_ptr<T>&) {return false;}
+
+template<typename T>
+bool traced_fold(const rule_set<T>& rules, const term_ptr<T>& t, term_ptr<T>& out)
+{
+    return rules.natives().fold(t, out);
+}
+
+/*!
+ * \brief the bindings of pattern's variables in t, read off by position, t is
+ * known to match so only the shape is checked
+ */
+template<typename T>
+void read_bindings(term<T>& pattern, const term_ptr<T>& t, Sub<T>& sigma)
+{
+    if( pattern.isVariable() )
+    {
+        std::string name = static_cast<variable<T>&>(pattern).var();
+        if( !sigma.contains(name) )
+        {
+            sigma.extend(name, t);
+        }
+        return;
+    }
+    auto& children = pattern.children();
+    if( children.size() != t->children().size() )
+    {
+        throw InvalidRuleException();
+    }
+    for(size_t i = 0; i < children.size(); ++i)
+    {
+        read_bindings(*children[i], t->children()[i], sigma);
+    }
+}
+
+/*!
+ * \brief rebuilds every term of a run
+ * \param term_ptr<T> t is the term the run started from
+ * \param Rules& rules are the rules it ran with, a std::vector<rule<T>> or a rule_set<T>
+ * \param std::vector<trace_step>& run is one run from read_trace
+ * \param Visit visit is called with each step and the term after it
+ *
+ * \return term_ptr<T> the term at the end of the run
+ * \throw TraceGapException at a trace_lost step, or if the steps don't go 0, 1, 2, ...
+ */
+template<typename T, typename Rules, typename Visit>
+term_ptr<T> replay(term_ptr<T> t, const Rules& rules, const std::vector<trace_step>& run, Visit visit)
+{
+    uint32_t next = 0;
+    for(auto& s: run)
+    {
+        if( s.rule == trace_lost || s.step != next++ )
+        {
+            throw TraceGapException();
+        }
+        term_ptr<T> at = t;
+        for(auto child: s.at)
+        {
+            if( child == 0 || child > at->children().size() )
+            {
+                throw InvalidPathException();
+            }
+            at = at->children()[child - 1];
+        }
+
+        term_ptr<T> out;
+        if( s.rule == trace_fold )
+        {
+            if( !traced_fold(rules, at, out) )
+            {
+                throw InvalidRuleException();
+            }
+        }
+        else
+        {
+            const rule<T>& r = traced_rule(rules, s.rule);
+            Sub<T> sigma;
+            read_bindings(*r.first, at, sigma);
+            out = r.second->rewrite(sigma);
+        }
+        t = replace_at(t, s.at, 0, out);
+        visit(s, t);
+    }
+    return t;
+}
+
+#endif // TRACE_HPP
@@ -0,0 +1,302 @@
+#ifndef UNIFIER_HPP
+#define UNIFIER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <unordered_map>
+#include "Term.hpp"
+
+/**
+ * Two way syntactic unification, Huet style.
+ *
+ * unify() in Term.hpp is really one way matching, this is the real thing.
+ * Every variable (by name) and every other node gets a slot in a union-find,
+ * unifying two terms merges their classes, and each class remembers one
+ * non-variable node as its schema. Classes are merged before their children
+ * are looked at, so a shared subterm is only ever unified once, and with
+ * union by rank and path compression the whole thing runs in near linear time.
+ *
+ * The occurs check is put off until the end and done as one pass looking for
+ * a cycle through the schemas, which is what keeps it linear. It can be turned
+ * off, but then resolve() will throw on a cyclic answer.
+ *
+ * Variables with the same name are the same variable, use rename_apart first
+ * if the two terms' variables shouldn't be shared.
+ */
+template<typename T>
+class unifier
+{
+public:
+    unifier(bool occurs_check = true):
+        _occurs{occurs_check}
+    {}
+
+    /*!
+     * \brief unifies a with b on top of everything unified so far
+     *
+     * \return bool if there is a unifier, once this fails the unifier is spent
+     */
+    bool unify(const term_ptr<T>& a, const term_ptr<T>& b)
+    {
+        if( _failed )
+        {
+            return false;
+        }
+        _resolved.clear();
+
+        std::vector< std::pair<size_t, size_t> > todo{ {_id(a), _id(b)} };
+        while( !todo.empty() )
+        {
+            size_t x = _find(todo.back().first);
+            size_t y = _find(todo.back().second);
+            todo.pop_back();
+            if( x == y )
+            {
+                continue;
+            }
+
+            size_t sx = _schema[x], sy = _schema[y];
+            _union(x, y, sx != none ? sx : sy);
+            if( sx == none || sy == none )
+            {
+                continue;
+            }
+
+            term<T>& s = *_node[sx];
+            term<T>& t = *_node[sy];
+            if( s.isLiteral() || t.isLiteral() )
+            {
+                if( !(s == t) )
+                {
+                    return _failed = true, false;
+                }
+                continue;
+            }
+            auto& f = static_cast<function<T>&>(s);
+            auto& g = static_cast<function<T>&>(t);
+            if( f.name() != g.name() || f.children().size() != g.children().size() )
+            {
+                return _failed = true, false;
+            }
+            for(size_t i = 0; i < f.children().size(); ++i)
+            {
+                todo.emplace_back(_id(f.children()[i]), _id(g.children()[i]));
+            }
+        }
+
+        if( _occurs && !_acyclic() )
+        {
+            return _failed = true, false;
+        }
+        return true;
+    }
+
+    /*!
+     * \brief applies the most general unifier to t, subterms that resolve to
+     * the same class come back as the same shared node
+     *
+     * \throw CyclicTermException if the occurs check was off and the answer is cyclic
+     */
+    term_ptr<T> resolve(const term_ptr<T>& t)
+    {
+        size_t r = _find(_id(t));
+        std::vector<int> state(_parent.size(), 0);
+        return _resolve(r, state);
+    }
+
+    /*!
+     * \brief the most general unifier as a substitution, one entry per variable that got bound
+     */
+    Sub<T> substitution()
+    {
+        Sub<T> sigma;
+        for(auto& v: _vars)
+        {
+            term_ptr<T> r = resolve(_node[v.second]);
+            if( !(r->isVariable() && static_cast<variable<T>&>(*r).var() == v.first) )
+            {
+                sigma.extend(v.first, r);
+            }
+        }
+        return sigma;
+    }
+
+private:
+    static constexpr size_t none = size_t(-1);
+
+    size_t _id(const term_ptr<T>& t)
+    {
+        if( t->isVariable() )
+        {
+            std::string name = static_cast<variable<T>&>(*t).var();
+            auto found = _vars.find(name);
+            if( found != _vars.end() )
+            {
+                return found->second;
+            }
+            return _vars[name] = _make(t, none);
+        }
+        auto found = _nodes.find(t.get());
+        if( found != _nodes.end() )
+        {
+            return found->second;
+        }
+        size_t id = _make(t, _parent.size());
+        _nodes[t.get()] = id;
+        for(auto& c: t->children())
+        {
+            _id(c);
+        }
+        return id;
+    }
+
+    size_t _make(const term_ptr<T>& t, size_t schema)
+    {
+        _parent.push_back(_parent.size());
+        _rank.push_back(0);
+        _node.push_back(t);
+        _schema.push_back(schema);
+        return _parent.size() - 1;
+    }
+
+    size_t _find(size_t x)
+    {
+        // Path halving
+        while( _parent[x] != x )
+        {
+            _parent[x] = _parent[_parent[x]];
+            x = _parent[x];
+        }
+        return x;
+    }
+
+    void _union(size_t x, size_t y, size_t schema)
+    {
+        if( _rank[x] < _rank[y] )
+        {
+            std::swap(x, y);
+        }
+        _parent[y] = x;
+        if( _rank[x] == _rank[y] )
+        {
+            ++_rank[x];
+        }
+        _schema[x] = schema;
+    }
+
+    /*!
+     * \brief depth first search for a cycle through the schemas, that's a failed occurs check
+     */
+    bool _acyclic()
+    {
+        // 0 unseen, 1 on the stack, 2 done
+        std::vector<int> state(_parent.size(), 0);
+        std::vector< std::pair<size_t, size_t> > stack;
+        for(size_t start = 0; start < _parent.size(); ++start)
+        {
+            size_t r = _find(start);
+            if( state[r] != 0 )
+            {
+                continue;
+            }
+            state[r] = 1;
+            stack.emplace_back(r, 0);
+            while( !stack.empty() )
+            {
+                size_t c = stack.back().first;
+                size_t& i = stack.back().second;
+                size_t s = _schema[c];
+                if( s == none || i >= _node[s]->children().size() )
+                {
+                    state[c] = 2;
+                    stack.pop_back();
+                    continue;
+                }
+                size_t child = _find(_id(_node[s]->children()[i++]));
+                if( state[child] == 1 )
+                {
+                    return false;
+                }
+                if( state[child] == 0 )
+                {
+                    state[child] = 1;
+                    stack.emplace_back(child, 0);
+                }
+            }
+        }
+        return true;
+    }
+
+    term_ptr<T> _resolve(size_t r, std::vector<int>& state)
+    {
+        auto done = _resolved.find(r);
+        if( done != _resolved.end() )
+        {
+            return done->second;
+        }
+        size_t s = _schema[r];
+        if( s == none )
+        {
+            return _resolved[r] = _node[r];
+        }
+        if( !_node[s]->isFunction() )
+        {
+            return _resolved[r] = _node[s];
+        }
+        if( state[r] == 1 )
+        {
+            throw CyclicTermException();
+        }
+        state[r] = 1;
+        auto& f = static_cast<function<T>&>(*_node[s]);
+        std::vector< term_ptr<T> > subterms;
+        subterms.reserve(f.children().size());
+        for(auto& c: f.children())
+        {
+            subterms.push_back(_resolve(_find(_id(c)), state));
+        }
+        state[r] = 2;
+        return _resolved[r] = make_term<function<T>>(f.name(), f.arity(), std::move(subterms));
+    }
+
+    bool _occurs;
+    bool _failed{false};
+
+    // One slot per variable name and per other node
+    std::vector<size_t> _parent;
+    std::vector<size_t> _rank;
+    std::vector< term_ptr<T> > _node;
+    std::vector<size_t> _schema;
+
+    std::unordered_map<std::string, size_t> _vars;
+    std::unordered_map<term<T>*, size_t> _nodes;
+    std::unordered_map<size_t, term_ptr<T>> _resolved;
+};
+
+/*!
+ * \brief renames every variable in t by adding suffix to it, so two terms can be unified apart
+ */
+template<typename T>
+term_ptr<T> rename_apart(const term_ptr<T>& t, const std::string& suffix)
+{
+    if( t->isVariable() )
+    {
+        return make_term<variable<T>>(static_cast<variable<T>&>(*t).var() + suffix);
+    }
+    if( !t->isFunction() )
+    {
+        return t;
+    }
+    auto& f = static_cast<function<T>&>(*t);
+    std::vector< term_ptr<T> > subterms;
+    subterms.reserve(f.children().size());
+    for(auto& c: f.children())
+    {
+        subterms.push_back(rename_apart(c, suffix));
+    }
+    return make_term<function<T>>(f.name(), f.arity(), std::move(subterms));
+}
+
+#endif // UNIFIER_HPP